@@ -1,5 +1,8 @@
-#include <cmath>
+#include <cstddef>
+#include <cstring>
 
+#include "arp_core.h"
+#include "arp_hal.h"
 #include "daisy_patch_sm.h"
 #include "daisysp.h"
 
@@ -12,325 +15,439 @@ daisy::patch_sm::DaisyPatchSM hw;
 // Button for internal clock toggle
 Switch clock_button;
 
-// Arpeggiator state
-float base_note_cv = 0.0f;         // CV input for base note (1V/octave)
-int quantized_note = 0;            // Quantized MIDI note number (C4 = 60)
-int next_quantized_note = 0;       // Next note to use (after pattern completes)
-bool note_change_pending = false;  // Flag to indicate note change is waiting
-float bpm = 120.0f;                // Detected BPM
-uint32_t last_gate_time = 0;       // Time of last gate trigger
-bool gate_triggered = false;       // Gate trigger flag
-int arp_step = 0;                  // Current step in arpeggio (0-3)
-uint32_t last_step_time = 0;       // Time of last arpeggio step
-float step_interval_ms = 125.0f;   // Time between steps (ms) - 120 BPM = 500ms
-                                   // per quarter, 4 notes = 125ms each
-
-// Internal clock state
-bool internal_clock_enabled = false;    // Toggle for internal clock
-uint32_t last_internal_clock_time = 0;  // Time of last internal clock tick
-
-// Tempo control constants
-const float MIN_BPM = 20.0f;
-const float MAX_BPM = 200.0f;
-
-// Dominant 7th chord intervals (in semitones from root)
-const int chord_intervals[4] = {0, 4, 7,
-                                10};  // Root, Major 3rd, Perfect 5th, Minor 7th
-
-// Arpeggio pattern types
-enum ArpPattern {
-  ARP_UP = 0,        // 0, 1, 2, 3 (4 steps)
-  ARP_DOWN,          // 3, 2, 1, 0 (4 steps)
-  ARP_UP_DOWN,       // 0, 1, 2, 3, 2, 1 (6 steps, smooth bounce)
-  ARP_DOWN_UP,       // 3, 2, 1, 0, 1, 2 (6 steps, smooth bounce)
-  ARP_RANDOM,        // Random order (4 steps)
-  ARP_1_3_2_4,       // 0, 2, 1, 3 (4 steps, custom pattern)
-  ARP_PATTERN_COUNT  // Total number of patterns
+// Push button on B7 (held at power-up to enter CV output calibration,
+// selects the external clock source or taps the tempo while running)
+Switch button;
+
+// Audio passthrough
+// Build with ARP_AUDIO_PASSTHROUGH=0 to output silence instead of copying in
+// to out.
+#ifndef ARP_AUDIO_PASSTHROUGH
+#define ARP_AUDIO_PASSTHROUGH 1
+#endif
+
+// Profiling
+// Cycle counts come from the DWT cycle counter and reports go out over the
+// USB serial log (see arp_core.h).
+const uint32_t PROFILE_REPORT_MS = 1000;  // Time between reports
+const uint32_t CPU_CYCLES_PER_US = 480;   // Cortex-M7 core clock (MHz)
+
+uint32_t profile_last_report = 0;  // System::GetNow() of the last report
+
+// MIDI input
+// USB MIDI on the Patch SM's USB port. The handler parses incoming packets
+// in the USB receive interrupt into its own fixed-size event queue, which
+// the engine drains once per audio block. The USB serial log uses the same
+// port, so a profiling build has to leave MIDI out.
+#if ARP_MIDI && ARP_PROFILE
+#error "USB MIDI and the profiling log share the USB port, unset ARP_MIDI"
+#endif
+
+#if ARP_MIDI
+MidiUsbHandler midi;
+#endif
+
+// Control task
+// Controls are processed from a TIM5 period interrupt at CONTROL_RATE_HZ
+// instead of a loop with a 1ms delay, so the control period is fixed
+// whatever the work takes (the switch debounce relies on it) and the main
+// loop sleeps in WFI between interrupts. The audio interrupt has to preempt
+// it, as it did the main loop, so a long control pass never delays a step.
+TimerHandle control_timer;
+
+// CV output calibration, stored in QSPI flash
+PersistentStorage<CvCalibration> calibration_storage(hw.qspi);
+
+// Preset storage
+// The preset bank is written to a log of PRESET_SLOTS records over
+// PRESET_SECTORS QSPI sectors clear of the calibration, each save in the
+// next slot with a higher sequence number, and the newest valid record is
+// loaded at boot. A sector is only erased when the log comes back round to
+// it, so each one is erased once every PRESET_SLOTS saves where
+// PersistentStorage would erase its one location on every save. Saves run
+// from the main loop one flash operation (erase, then program) per pass, so
+// the audio and control interrupts preempt them like the rest of the loop.
+const uint32_t PRESET_STORAGE_OFFSET = 0x10000;  // QSPI offset of the log
+const uint32_t QSPI_SECTOR_SIZE = 4096;          // Smallest erasable block
+const uint32_t PRESET_SECTORS = 4;               // Sectors in the log
+const uint32_t PRESET_SLOT_SIZE = 256;           // One QSPI page per record
+const uint32_t PRESET_SLOTS_PER_SECTOR = QSPI_SECTOR_SIZE / PRESET_SLOT_SIZE;
+const uint32_t PRESET_SLOTS = PRESET_SECTORS * PRESET_SLOTS_PER_SECTOR;
+const uint32_t PRESET_RECORD_MAGIC = 0x50505241;  // "ARPP"
+
+struct PresetRecord {
+  uint32_t magic;     // PRESET_RECORD_MAGIC
+  uint32_t sequence;  // Increments with every save
+  PresetBank bank;
+  uint32_t checksum;  // FNV-1a of the fields above
 };
 
-// Pattern sequences
-const int pattern_up[4] = {0, 1, 2, 3};
-const int pattern_down[4] = {3, 2, 1, 0};
-const int pattern_up_down[6] = {0, 1, 2, 3, 2, 1};
-const int pattern_down_up[6] = {3, 2, 1, 0, 1, 2};
-const int pattern_1_3_2_4[4] = {0, 2, 1, 3};
-
-// Pattern lengths
-const int pattern_lengths[ARP_PATTERN_COUNT] = {
-    4,  // UP
-    4,  // DOWN
-    6,  // UP_DOWN
-    6,  // DOWN_UP
-    4,  // RANDOM
-    4   // 1_3_2_4
+static_assert(sizeof(PresetRecord) <= PRESET_SLOT_SIZE,
+              "a preset record has to fit in one slot");
+
+enum PresetWriteState {
+  PRESET_WRITE_IDLE = 0,  // Waiting for a save
+  PRESET_WRITE_ERASE,     // Erase the sector the next slot starts
+  PRESET_WRITE_PROGRAM,   // Program the next slot
 };
 
-// Current pattern
-ArpPattern current_pattern = ARP_UP;
-int pattern_length = 4;
-
-// Function to quantize CV to nearest semitone and return MIDI note number
-int QuantizeCvToNote(float cv_normalized) {
-  // cv_normalized is -1.0 to 1.0 representing -5V to 5V
-  // Convert to actual voltage
-  float cv_volts = cv_normalized * 5.0f;
-
-  // 1V/octave standard: C0 (MIDI 12) = 0.0833V (1/12 volt)
-  // This means 0V = B-1 (MIDI 11)
-  // Each semitone = 1/12 V = 0.0833V
-  // Formula: voltage = (midi_note - 11) / 12
-  // Inverse: midi_note = (voltage * 12) + 11
-  float note_float = cv_volts * 12.0f + 11.0f;  // Convert to MIDI note
-  return static_cast<int>(roundf(note_float));  // Quantize to nearest semitone
+PresetRecord preset_record;                               // Record to write
+PresetWriteState preset_write_state = PRESET_WRITE_IDLE;  // Save progress
+uint32_t preset_next_slot = 0;      // Log slot the next save goes in
+uint32_t preset_next_sequence = 0;  // Sequence number of the next save
+
+// Hardware abstraction layer for the Patch SM
+namespace hal {
+
+float ReadCv(CvInput input) { return hw.GetAdcValue(patch_sm::CV_1 + input); }
+
+// The latest conversion in the ADC DMA buffer, scaled like the bipolar
+// AnalogControl behind GetAdcValue (inverted input stage, 0.5 = 0V)
+float SampleCv(CvInput input) {
+  return (0.5f - hw.adc.GetFloat(patch_sm::CV_1 + input)) * 2.0f;
 }
 
-// Function to convert MIDI note to CV voltage (1V/octave)
-// Returns voltage value (not normalized)
-float NoteToCv(int midi_note) {
-  // 1V/octave standard: C0 (MIDI 12) = 0.0833V
-  // 0V = B-1 (MIDI 11)
-  return (midi_note - 11) / 12.0f;
+bool ReadGate(GateInput input) {
+  return input == GATE_IN_1 ? hw.gate_in_1.State() : hw.gate_in_2.State();
 }
 
-// Function to get the chord interval index based on current pattern and step
-int GetPatternIndex(ArpPattern pattern, int step) {
-  switch (pattern) {
-    case ARP_UP:
-      return pattern_up[step % 4];
-    case ARP_DOWN:
-      return pattern_down[step % 4];
-    case ARP_UP_DOWN:
-      return pattern_up_down[step % 6];
-    case ARP_DOWN_UP:
-      return pattern_down_up[step % 6];
-    case ARP_RANDOM:
-      return rand() % 4;  // Random 0-3
-    case ARP_1_3_2_4:
-      return pattern_1_3_2_4[step % 4];
-    default:
-      return pattern_up[step % 4];
+void WriteGate(GateOutput output, bool state) {
+  if (output == GATE_OUT_1) {
+    hw.gate_out_1.Write(state);
+  } else {
+    hw.gate_out_2.Write(state);
   }
 }
 
-// Function to select pattern based on CV_1 input
-ArpPattern SelectPattern(float cv_normalized) {
-  // CV inputs return -1.0 to 1.0 for bipolar (-5V to +5V)
-  // But pots on Patch.init() are wired 0-5V, so we get roughly 0.0 to 1.0
-  // Map the input range to 0.0 to 1.0 for pattern selection
-  float cv_0_to_1;
-  if (cv_normalized < 0.0f) {
-    // Handle any negative values (bipolar CV input)
-    cv_0_to_1 = (cv_normalized + 1.0f) / 2.0f;
-  } else {
-    // Pot gives 0.0 to 1.0 range directly
-    cv_0_to_1 = cv_normalized;
+void WriteCv(CvOutput output, float volts) {
+  hw.WriteCvOut(output == CV_OUT_1 ? patch_sm::CV_OUT_1 : patch_sm::CV_OUT_2,
+                volts);
+}
+
+ButtonState ReadButton() {
+  ButtonState state;
+  state.pressed = button.Pressed();
+  state.rising_edge = button.RisingEdge();
+  state.falling_edge = button.FallingEdge();
+  state.held_ms = button.TimeHeldMs();
+  return state;
+}
+
+// Clock and note messages only; anything else is skipped
+bool ReadMidi(MidiMessage* message) {
+#if ARP_MIDI
+  while (midi.HasEvents()) {
+    MidiEvent event = midi.PopEvent();
+    if (event.type == NoteOn || event.type == NoteOff) {
+      message->status = event.type == NoteOn ? MIDI_NOTE_ON : MIDI_NOTE_OFF;
+      message->note = event.data[0];
+      message->velocity = event.data[1];
+      return true;
+    }
+    if (event.type != SystemRealTime) continue;
+    switch (event.srt_type) {
+      case TimingClock:
+        message->status = MIDI_CLOCK;
+        return true;
+      case Start:
+        message->status = MIDI_START;
+        return true;
+      case Continue:
+        message->status = MIDI_CONTINUE;
+        return true;
+      case Stop:
+        message->status = MIDI_STOP;
+        return true;
+      default:
+        break;
+    }
+  }
+#else
+  (void)message;
+#endif
+  return false;
+}
+
+bool ReadToggle() { return clock_button.Pressed(); }
+
+void SetLed(bool on) { hw.SetLed(on); }
+
+uint32_t RandomValue() { return hw.GetRandomValue(); }
+
+}  // namespace hal
+
+// Function to start the cycle counter
+void InitProfile() {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Function to print one measurement to the USB serial log
+void PrintTimingStat(const char* name, const char* unit,
+                     const TimingStat& stat) {
+  hw.PrintLine("%s: n=%u min=%u mean=%u max=%u %s", name, stat.Count(),
+               stat.Min(), stat.Mean(), stat.Max(), unit);
+  hw.PrintLine("  %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u %u",
+               stat.Bucket(0), stat.Bucket(1), stat.Bucket(2), stat.Bucket(3),
+               stat.Bucket(4), stat.Bucket(5), stat.Bucket(6), stat.Bucket(7),
+               stat.Bucket(8), stat.Bucket(9), stat.Bucket(10),
+               stat.Bucket(11), stat.Bucket(12), stat.Bucket(13),
+               stat.Bucket(14), stat.Bucket(15));
+}
+
+// Function to print and clear the measurements every PROFILE_REPORT_MS
+// (called from the main loop)
+void ReportProfile() {
+  uint32_t now = System::GetNow();
+  if (now - profile_last_report < PROFILE_REPORT_MS) return;
+  profile_last_report = now;
+
+  // Take a consistent copy; AudioCallback adds to it between blocks
+  __disable_irq();
+  Profile report = profile;
+  ResetProfile();
+  __enable_irq();
+
+  PrintTimingStat("control", "cycles", report.control);
+  PrintTimingStat("callback", "cycles", report.callback);
+  hw.PrintLine("callback max: %u us",
+               report.callback.Max() / CPU_CYCLES_PER_US);
+  PrintTimingStat("step lateness", "samples", report.step_lateness);
+  PrintTimingStat("clock jitter", "samples", report.clock_jitter);
+  hw.PrintLine("clock outliers: %u", report.clock_outliers);
+  hw.PrintLine("dropped: %u steps, %u clock edges, %u midi notes",
+               report.step_underruns, report.clock_edges_dropped,
+               report.midi_notes_dropped);
+}
+
+// Function to get the QSPI offset of a preset log slot
+uint32_t PresetSlotOffset(uint32_t slot) {
+  return PRESET_STORAGE_OFFSET + slot * PRESET_SLOT_SIZE;
+}
+
+// Function to checksum a preset record (FNV-1a over its fields)
+uint32_t PresetChecksum(const PresetRecord& record) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&record);
+  size_t length = offsetof(PresetRecord, bank) + sizeof(PresetBank);
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) hash = (hash ^ bytes[i]) * 16777619u;
+  return hash;
+}
+
+// Function to load the newest valid preset record from the log; returns
+// false if there is none
+// Erased or half-written slots fail the magic or checksum test, and the
+// next save goes in the slot after the newest record.
+bool LoadPresets(PresetBank* bank) {
+  const PresetRecord* newest = nullptr;
+  for (uint32_t slot = 0; slot < PRESET_SLOTS; slot++) {
+    const PresetRecord* record = static_cast<const PresetRecord*>(
+        hw.qspi.GetData(PresetSlotOffset(slot)));
+    if (record->magic != PRESET_RECORD_MAGIC ||
+        record->checksum != PresetChecksum(*record)) {
+      continue;
+    }
+    if (newest &&
+        static_cast<int32_t>(record->sequence - newest->sequence) < 0) {
+      continue;
+    }
+    newest = record;
+    preset_next_slot = (slot + 1) % PRESET_SLOTS;
+    preset_next_sequence = record->sequence + 1;
+  }
+  if (!newest) return false;
+  *bank = newest->bank;
+  return true;
+}
+
+// Function to store the preset bank one flash operation per call (called
+// from the main loop)
+void ProcessPresetWrite() {
+  switch (preset_write_state) {
+    case PRESET_WRITE_IDLE: {
+      // Take a consistent copy; the control task owns the bank
+      __disable_irq();
+      bool saved = ArpTakePresetSave(&preset_record.bank);
+      __enable_irq();
+      if (!saved) return;
+      preset_record.magic = PRESET_RECORD_MAGIC;
+      preset_record.sequence = preset_next_sequence;
+      preset_record.checksum = PresetChecksum(preset_record);
+      preset_write_state = preset_next_slot % PRESET_SLOTS_PER_SECTOR == 0
+                               ? PRESET_WRITE_ERASE
+                               : PRESET_WRITE_PROGRAM;
+      break;
+    }
+    case PRESET_WRITE_ERASE:
+      hw.qspi.EraseSector(PresetSlotOffset(preset_next_slot));
+      preset_write_state = PRESET_WRITE_PROGRAM;
+      break;
+    case PRESET_WRITE_PROGRAM:
+      hw.qspi.Write(PresetSlotOffset(preset_next_slot), sizeof(PresetRecord),
+                    reinterpret_cast<uint8_t*>(&preset_record));
+      preset_next_slot = (preset_next_slot + 1) % PRESET_SLOTS;
+      preset_next_sequence++;
+      preset_write_state = PRESET_WRITE_IDLE;
+      break;
+  }
+}
+
+// Function to run the CV output calibration until the button is pressed
+// CV_OUT_1 plays a reference note (1V with the toggle off, 4V with it on).
+// Knob 1 trims the offset and knob 2 the scale; tune the 1V note with knob 1,
+// then the 4V note with knob 2, and press the button to save.
+void RunCalibration(CvCalibration& cal) {
+  // Wait for the button held at power-up to be released
+  do {
+    button.Debounce();
+    hw.Delay(1);
+  } while (button.Pressed());
+
+  while (1) {
+    hw.ProcessAllControls();
+    button.Debounce();
+    clock_button.Debounce();
+
+    float offset_knob = hw.GetAdcValue(patch_sm::CV_1);
+    float scale_knob = hw.GetAdcValue(patch_sm::CV_2);
+    cal.offset = (offset_knob * 2.0f - 1.0f) * CAL_OFFSET_RANGE;
+    cal.scale = 1.0f + (scale_knob * 2.0f - 1.0f) * CAL_SCALE_RANGE;
+
+    int reference = clock_button.Pressed() ? CAL_HIGH_NOTE : CAL_LOW_NOTE;
+    hw.WriteCvOut(patch_sm::CV_OUT_1, CalibratedNoteToCv(reference, cal));
+    hw.SetLed(true);
+
+    if (button.RisingEdge()) break;
+    hw.Delay(1);
   }
 
-  // Clamp to 0-1 range
-  if (cv_0_to_1 < 0.0f) cv_0_to_1 = 0.0f;
-  if (cv_0_to_1 > 1.0f) cv_0_to_1 = 1.0f;
+  hw.SetLed(false);
+  cal.version = CV_CALIBRATION_VERSION;
+  calibration_storage.Save();
+}
+
+// Function to run the control task (TIM5 interrupt, CONTROL_RATE_HZ)
+void ControlCallback(void*) {
+#if ARP_PROFILE
+  uint32_t start_cycles = DWT->CYCCNT;
+#endif
+
+  // Process all controls (CV and Gate inputs)
+  hw.ProcessAllControls();
 
-  // Divide range into equal segments for each pattern
-  int pattern_index = static_cast<int>(cv_0_to_1 * ARP_PATTERN_COUNT);
+  // Debounce the clock toggle switch and the button
+  clock_button.Debounce();
+  button.Debounce();
 
-  // Clamp to valid range
-  if (pattern_index >= ARP_PATTERN_COUNT) pattern_index = ARP_PATTERN_COUNT - 1;
+  // Read the controls and compute the next steps for the scheduler
+  ArpProcessControls();
 
-  return static_cast<ArpPattern>(pattern_index);
+#if ARP_PROFILE
+  profile.control.Add(DWT->CYCCNT - start_cycles);
+#endif
 }
 
 // Audio callback function
 void AudioCallback(AudioHandle::InputBuffer in, AudioHandle::OutputBuffer out,
                    size_t size) {
-  for (size_t i = 0; i < size; i++) {
-    // Pass through audio for now
-    out[0][i] = in[0][i];
-    out[1][i] = in[1][i];
-  }
+#if ARP_PROFILE
+  uint32_t start_cycles = DWT->CYCCNT;
+#endif
+
+#if ARP_MIDI
+  // Move anything the transport received into the handler's event queue
+  midi.Listen();
+#endif
+
+  // Capture the clock and run the step scheduler first so outputs change at
+  // the start of the block
+  ArpProcessBlock(in[0], size);
+
+#if ARP_AUDIO_PASSTHROUGH
+  // Pass through audio, one block copy per channel
+  memcpy(out[0], in[0], size * sizeof(float));
+  memcpy(out[1], in[1], size * sizeof(float));
+#else
+  memset(out[0], 0, size * sizeof(float));
+  memset(out[1], 0, size * sizeof(float));
+#endif
+
+#if ARP_PROFILE
+  profile.callback.Add(DWT->CYCCNT - start_cycles);
+#endif
 }
 
 int main(void) {
   // Initialize hardware
   hw.Init();
-  hw.SetAudioBlockSize(4);  // Number of samples handled per callback
+  hw.SetAudioBlockSize(AUDIO_BLOCK_SIZE);  // Number of samples per callback
   hw.SetAudioSampleRate(SaiHandle::Config::SampleRate::SAI_48KHZ);
 
   // Initialize toggle switch on B8 for internal clock
-  clock_button.Init(daisy::patch_sm::DaisyPatchSM::B8, 1000.0f,
+  clock_button.Init(daisy::patch_sm::DaisyPatchSM::B8, CONTROL_RATE_HZ,
                     Switch::TYPE_TOGGLE, Switch::POLARITY_INVERTED,
                     GPIO::Pull::PULLUP);
 
+  // Initialize push button on B7
+  button.Init(daisy::patch_sm::DaisyPatchSM::B7, CONTROL_RATE_HZ,
+              Switch::TYPE_MOMENTARY, Switch::POLARITY_INVERTED,
+              GPIO::Pull::PULLUP);
+
+  // Load the CV output calibration (factory defaults if nothing is stored or
+  // the stored layout is out of date), calibrate if the button is held
+  calibration_storage.Init(default_calibration);
+  CvCalibration& calibration = calibration_storage.GetSettings();
+  if (calibration.version != CV_CALIBRATION_VERSION) {
+    calibration = default_calibration;
+  }
+  for (int i = 0; i < 10; i++) {
+    button.Debounce();
+    hw.Delay(1);
+  }
+  if (button.Pressed()) RunCalibration(calibration);
+
+  // Load the presets (power-up settings if none are stored) and start from
+  // the last one saved or recalled
+  PresetBank stored_presets;
+  bool presets_found = LoadPresets(&stored_presets);
+  ArpInit(calibration, presets_found ? &stored_presets : nullptr);
+
+#if ARP_PROFILE
+  // Timing reports go out over USB serial
+  hw.StartLog(false);
+  InitProfile();
+#endif
+
+#if ARP_MIDI
+  // MIDI clock and notes over USB
+  MidiUsbHandler::Config midi_config;
+  midi_config.transport_config.periph = MidiUsbTransport::Config::INTERNAL;
+  midi.Init(midi_config);
+  midi.StartReceive();
+#endif
+
   // Start audio
   hw.StartAudio(AudioCallback);
 
-  // Loop forever
+  // Start the control task
+  TimerHandle::Config timer_config;
+  timer_config.periph = TimerHandle::Config::Peripheral::TIM_5;
+  timer_config.dir = TimerHandle::Config::CounterDir::UP;
+  timer_config.enable_irq = true;
+  control_timer.Init(timer_config);
+  control_timer.SetPeriod(control_timer.GetFreq() / CONTROL_RATE_HZ - 1);
+  control_timer.SetCallback(ControlCallback);
+  control_timer.Start();
+
+  // Loop forever - controls are processed in ControlCallback and steps are
+  // scheduled in AudioCallback, so store saved presets and sleep until the
+  // next interrupt
   while (1) {
-    // Process all controls (CV and Gate inputs)
-    hw.ProcessAllControls();
-
-    // Debounce the clock toggle switch
-    clock_button.Debounce();
-
-    // Read the toggle switch state directly (on = internal clock, off =
-    // external)
-    bool prev_internal_clock_enabled = internal_clock_enabled;
-    internal_clock_enabled = clock_button.Pressed();
-
-    // Read CV_2 for tempo control
-    // Pots on Patch.init() return 0 to 1 range
-    float tempo_cv = hw.GetAdcValue(patch_sm::CV_2);
-    // Handle pot (0 to 1) or bipolar CV (-1 to +1)
-    float tempo_cv_normalized;
-    if (tempo_cv < 0.0f) {
-      // Bipolar CV input: convert -1..+1 to 0..1
-      tempo_cv_normalized = (tempo_cv + 1.0f) / 2.0f;
-    } else {
-      // Pot: already 0..1
-      tempo_cv_normalized = tempo_cv;
-    }
-    // Clamp to 0-1 range
-    if (tempo_cv_normalized < 0.0f) tempo_cv_normalized = 0.0f;
-    if (tempo_cv_normalized > 1.0f) tempo_cv_normalized = 1.0f;
-    float tempo_bpm = MIN_BPM + tempo_cv_normalized * (MAX_BPM - MIN_BPM);
-
-    // Update tempo from pot when internal clock is enabled
-    if (internal_clock_enabled) {
-      bpm = tempo_bpm;
-    }
-
-    // If we just disabled internal clock, reset the gate trigger state
-    if (!internal_clock_enabled && prev_internal_clock_enabled) {
-      gate_triggered = false;
-      last_gate_time = 0;
-    }
-
-    // Read CV input 1 for pattern selection (bipolar -5V to +5V)
-    float pattern_cv = hw.GetAdcValue(patch_sm::CV_1);
-    ArpPattern new_pattern = SelectPattern(pattern_cv);
-
-    // Update pattern if it changed
-    if (new_pattern != current_pattern) {
-      current_pattern = new_pattern;
-      pattern_length = pattern_lengths[current_pattern];
-      arp_step = 0;  // Reset step when pattern changes
-      // Recalculate step interval for new pattern length
-      float quarter_note_ms = 60000.0f / bpm;
-      step_interval_ms = quarter_note_ms / (float)pattern_length;
-    }
-
-    // Read CV input 5 for base note (bipolar -5V to +5V)
-    base_note_cv = hw.GetAdcValue(patch_sm::CV_5);
-
-    // Quantize to nearest semitone
-    int new_note = QuantizeCvToNote(base_note_cv);
-
-    // Check if the note has changed
-    if (new_note != quantized_note && new_note != next_quantized_note) {
-      // If we're in the middle of a pattern, queue the change
-      if (arp_step != 0 && gate_triggered) {
-        next_quantized_note = new_note;
-        note_change_pending = true;
-      } else {
-        // If at the start of a pattern or not playing, change immediately
-        quantized_note = new_note;
-        next_quantized_note = new_note;
-        note_change_pending = false;
-      }
-    }
-
-    // Handle clock source - either internal or external gate
-    if (internal_clock_enabled) {
-      // Internal clock mode: BPM controls note rate directly
-      // Calculate step interval from BPM (each beat = one note)
-      float step_interval_from_bpm = 60000.0f / bpm;
-      step_interval_ms = step_interval_from_bpm;
-
-      // Auto-start the arpeggio if not already triggered
-      if (!gate_triggered) {
-        gate_triggered = true;
-        arp_step = 0;
-        last_step_time = System::GetNow();
-      }
-    } else {
-      // External gate input mode (when switch is OFF)
-      bool clock_trigger = hw.gate_in_1.Trig();
-
-      if (clock_trigger) {
-        uint32_t current_time = System::GetNow();
-
-        // Calculate BPM from time between gates
-        if (last_gate_time > 0) {
-          uint32_t interval_ms = current_time - last_gate_time;
-          if (interval_ms > 0) {
-            // 1 gate = 1 quarter note
-            bpm = 60000.0f / interval_ms;
-            // Update step interval based on pattern length
-            step_interval_ms = interval_ms / (float)pattern_length;
-          }
-        }
-
-        last_gate_time = current_time;
-        gate_triggered = true;
-
-        // Reset arpeggio to start
-        arp_step = 0;
-        last_step_time = current_time;
-      }
-    }
-
-    // Arpeggiator logic - play notes if gate has been triggered
-    if (gate_triggered) {
-      uint32_t current_time = System::GetNow();
-
-      // Check if it's time for the next step
-      if (current_time - last_step_time >= step_interval_ms) {
-        // If we're at step 0 and there's a pending note change, apply it now
-        if (arp_step == 0 && note_change_pending) {
-          quantized_note = next_quantized_note;
-          note_change_pending = false;
-        }
-
-        // Get the chord index based on current pattern and step
-        int chord_index = GetPatternIndex(current_pattern, arp_step);
-
-        // Calculate the note for this step
-        int note_offset = chord_intervals[chord_index];
-        int current_note = quantized_note + note_offset;
-        float output_cv = NoteToCv(current_note);
-
-        // Output CV for the current note (0-5V range)
-        // Clamp to valid DAC range
-        if (output_cv < 0.0f) output_cv = 0.0f;
-        if (output_cv > 5.0f) output_cv = 5.0f;
-        hw.WriteCvOut(patch_sm::CV_OUT_1, output_cv);
-
-        // Output gate high
-        hw.gate_out_1.Write(true);
-
-        // Move to next step (wrap around based on pattern length)
-        arp_step = (arp_step + 1) % pattern_length;
-        last_step_time = current_time;
-
-        // Gate will be turned off in next iteration (short pulse)
-      } else if (current_time - last_step_time > 10) {
-        // Turn off gate after 10ms (short pulse)
-        hw.gate_out_1.Write(false);
-      }
-    } else {
-      // If not triggered, make sure gate is off
-      hw.gate_out_1.Write(false);
-    }
-
-    // Visual feedback - blink LED at tempo rate
-    // Calculate ms per beat from BPM
-    float ms_per_beat = 60000.0f / bpm;
-    // Get current position within the beat (0.0 to 1.0)
-    float beat_phase = fmodf(System::GetNow(), ms_per_beat) / ms_per_beat;
-    // LED on for first 25% of beat, off for rest
-    float led_value = (beat_phase < 0.25f) ? 5.0f : 0.0f;
-    hw.WriteCvOut(patch_sm::CV_OUT_2, led_value);
-
-    // Small delay to control update rate
-    hw.Delay(1);
+    ProcessPresetWrite();
+#if ARP_PROFILE
+    ReportProfile();
+#endif
+    __WFI();
   }
 }
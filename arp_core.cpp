@@ -0,0 +1,3187 @@
+#include "arp_core.h"
+
+#include <atomic>
+#include <cmath>
+
+#include "arp_hal.h"
+
+const uint32_t GATE_PULSE_SAMPLES = 480;  // Trigger gate length (10ms)
+
+// Lock-free single-producer / single-consumer ring buffer
+// The producer only writes head, the consumer only writes tail, so it can be
+// shared between an interrupt and the main loop without disabling interrupts.
+// Both sides run on the one core, so compiler fences are enough to keep the
+// item copy on the right side of the index update. N must be a power of two.
+template <typename T, size_t N>
+class SpscQueue {
+ public:
+  // Returns false (and drops the item) if the queue is full
+  bool Push(const T& item) {
+    uint32_t head = head_;
+    if (head - tail_ >= N) return false;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    items_[head & (N - 1)] = item;
+    std::atomic_signal_fence(std::memory_order_release);
+    head_ = head + 1;
+    return true;
+  }
+
+  // Returns false if the queue is empty, otherwise copies the oldest item
+  // without removing it (consumer only)
+  bool Peek(T* item) const {
+    uint32_t tail = tail_;
+    if (tail == head_) return false;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    *item = items_[tail & (N - 1)];
+    return true;
+  }
+
+  // Returns false if the queue is empty
+  bool Pop(T* item) {
+    uint32_t tail = tail_;
+    if (tail == head_) return false;
+    std::atomic_signal_fence(std::memory_order_acquire);
+    *item = items_[tail & (N - 1)];
+    std::atomic_signal_fence(std::memory_order_release);
+    tail_ = tail + 1;
+    return true;
+  }
+
+ private:
+  T items_[N];
+  volatile uint32_t head_ = 0;
+  volatile uint32_t tail_ = 0;
+};
+
+// Pseudo-random number generator (xorshift32)
+// A few cycles per number, no hidden global state (each context owns its own
+// generator, so it is safe in interrupts) and seedable for reproducible
+// sequences.
+class Random {
+ public:
+  constexpr void Seed(uint32_t seed) { state_ = seed ? seed : 0x9e3779b9u; }
+
+  constexpr uint32_t Next() {
+    uint32_t x = state_;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state_ = x;
+    return x;
+  }
+
+  // Uniform integer in [0, range), by multiply-shift instead of modulo
+  constexpr int Below(int range) {
+    return static_cast<int>((static_cast<uint64_t>(Next()) * range) >> 32);
+  }
+
+ private:
+  uint32_t state_ = 0x9e3779b9u;
+};
+
+// Tempo control constants
+const float MIN_BPM = 20.0f;
+const float MAX_BPM = 200.0f;
+
+// Tempo estimator for an external clock
+// Follows the clock period with a median over the last TEMPO_WINDOW_SIZE
+// intervals, smoothed by a one-pole filter, and follows its phase with a
+// first-order PLL that predicts the next edge. Edges further than
+// TEMPO_OUTLIER_TOLERANCE from the prediction are ignored unless
+// TEMPO_RELOCK_COUNT arrive in a row, which is treated as a tempo change.
+// An edge sooner than a beat at MAX_BPM after the last one is a burst and is
+// dropped, and one later than a beat at MIN_BPM follows a pause and starts
+// tracking over, so no interval outside the tempo range sets the period.
+// All times are in samples.
+const size_t TEMPO_WINDOW_SIZE = 8;           // Intervals in the median window
+const float TEMPO_OUTLIER_TOLERANCE = 0.1f;   // Max phase error (x period)
+const int TEMPO_RELOCK_COUNT = 3;             // Outliers in a row to relock
+const float TEMPO_LOCK_TOLERANCE = 0.02f;     // Phase error to report locked
+const float TEMPO_LOCK_TIME_BEATS = 4.0f;     // Default lock time (beats)
+const float TEMPO_MIN_INTERVAL = 60.0f * SAMPLE_RATE / MAX_BPM;  // Samples
+const float TEMPO_MAX_INTERVAL = 60.0f * SAMPLE_RATE / MIN_BPM;  // Samples
+
+class TempoEstimator {
+ public:
+  // Estimator state, exposed for measurement
+  struct State {
+    float period;          // Estimated beat period (samples)
+    float phase_error;     // Last edge minus predicted edge (samples)
+    uint32_t beat_sample;  // Filtered time of the last beat
+    uint32_t next_edge;    // Predicted time of the next edge
+    uint32_t edges;        // Edges seen since reset
+    uint32_t outliers;     // Edges rejected since reset
+    uint32_t relocks;      // Restarts from a single interval since reset
+    bool locked;           // Last phase error was within tolerance
+  };
+
+  void Init(float lock_time_beats) {
+    SetLockTime(lock_time_beats);
+    Reset();
+  }
+
+  // Lock time is roughly how many beats it takes to follow a tempo change
+  void SetLockTime(float lock_time_beats) {
+    gain_ = 1.0f / (lock_time_beats < 1.0f ? 1.0f : lock_time_beats);
+  }
+
+  void Reset() {
+    state_ = State();
+    window_count_ = 0;
+    window_pos_ = 0;
+    outlier_run_ = 0;
+    last_edge_ = 0;
+  }
+
+  // Move the beat to beat_sample and expect an edge there, keeping the
+  // period; used when the clock source restarts on a known downbeat. With no
+  // period yet tracking starts over from the next edge.
+  void Realign(uint32_t beat_sample) {
+    if (!HasPeriod()) {
+      Reset();
+      return;
+    }
+    uint32_t period = static_cast<uint32_t>(state_.period);
+    outlier_run_ = 0;
+    last_edge_ = beat_sample - period;
+    state_.phase_error = 0.0f;
+    state_.beat_sample = beat_sample - period;
+    state_.next_edge = beat_sample;
+    state_.locked = false;
+  }
+
+  // Feed a clock edge. Returns true if the edge updated the beat phase, false
+  // for the first edge (also after a pause), bursts and rejected outliers.
+  bool Process(uint32_t edge_sample) {
+    float interval = static_cast<float>(edge_sample - last_edge_);
+    if (state_.edges > 0 && interval < TEMPO_MIN_INTERVAL) {
+      state_.outliers++;
+      return false;
+    }
+    if (state_.edges > 0 && interval > TEMPO_MAX_INTERVAL) Reset();
+
+    state_.edges++;
+    bool prev_accepted = outlier_run_ == 0;
+    last_edge_ = edge_sample;
+
+    if (state_.edges == 1) {
+      state_.beat_sample = edge_sample;
+      return false;
+    }
+
+    if (state_.edges == 2) {
+      Relock(edge_sample, interval);
+      return true;
+    }
+
+    float error = static_cast<float>(
+        static_cast<int32_t>(edge_sample - state_.next_edge));
+    state_.phase_error = error;
+
+    if (fabsf(error) > TEMPO_OUTLIER_TOLERANCE * state_.period) {
+      state_.outliers++;
+      state_.locked = false;
+      if (++outlier_run_ >= TEMPO_RELOCK_COUNT) {
+        // Consistently off the prediction: the tempo really changed
+        Relock(edge_sample, interval);
+        return true;
+      }
+      // Flywheel through the bad edge on the predicted beat
+      state_.beat_sample = state_.next_edge;
+      state_.next_edge += static_cast<uint32_t>(state_.period);
+      return false;
+    }
+    outlier_run_ = 0;
+
+    // Frequency: smoothed median of the recent intervals
+    if (prev_accepted) {
+      window_[window_pos_] = interval;
+      window_pos_ = (window_pos_ + 1) % TEMPO_WINDOW_SIZE;
+      if (window_count_ < TEMPO_WINDOW_SIZE) window_count_++;
+      state_.period += gain_ * (Median() - state_.period);
+    }
+
+    // Phase: move the beat part of the way towards the edge
+    state_.beat_sample =
+        state_.next_edge + static_cast<int32_t>(gain_ * error);
+    state_.next_edge =
+        state_.beat_sample + static_cast<uint32_t>(state_.period);
+    state_.locked = fabsf(error) < TEMPO_LOCK_TOLERANCE * state_.period;
+    return true;
+  }
+
+  bool HasPeriod() const { return state_.edges >= 2; }
+  float Period() const { return state_.period; }
+  uint32_t BeatSample() const { return state_.beat_sample; }
+  const State& GetState() const { return state_; }
+
+ private:
+  // Restart tracking from a single interval
+  void Relock(uint32_t edge_sample, float interval) {
+    state_.relocks++;
+    window_[0] = interval;
+    window_count_ = 1;
+    window_pos_ = 1;
+    outlier_run_ = 0;
+    state_.period = interval;
+    state_.phase_error = 0.0f;
+    state_.beat_sample = edge_sample;
+    state_.next_edge = edge_sample + static_cast<uint32_t>(interval);
+    state_.locked = false;
+  }
+
+  // Median of the interval window (insertion sort of a copy, N is small)
+  float Median() const {
+    float sorted[TEMPO_WINDOW_SIZE];
+    for (size_t i = 0; i < window_count_; i++) {
+      float value = window_[i];
+      size_t j = i;
+      while (j > 0 && sorted[j - 1] > value) {
+        sorted[j] = sorted[j - 1];
+        j--;
+      }
+      sorted[j] = value;
+    }
+    if (window_count_ % 2) return sorted[window_count_ / 2];
+    return 0.5f * (sorted[window_count_ / 2 - 1] + sorted[window_count_ / 2]);
+  }
+
+  State state_;
+  float window_[TEMPO_WINDOW_SIZE];
+  size_t window_count_;
+  size_t window_pos_;
+  uint32_t last_edge_;
+  int outlier_run_;
+  float gain_;
+};
+
+// Audio onset detector
+// Turns transients on an audio input into clock edges. A fast envelope
+// follower is compared against an adaptive threshold that tracks the slow
+// background level, and after each onset the detector stays quiet for a
+// refractory period and until the envelope has dropped again. Works on whole
+// blocks and reports the onset to the sample, with well under 1ms of
+// detection latency.
+const float ONSET_ATTACK_MS = 0.1f;        // Fast envelope attack
+const float ONSET_RELEASE_MS = 5.0f;       // Fast envelope release
+const float ONSET_BACKGROUND_MS = 300.0f;  // Slow (background) envelope
+const float ONSET_THRESHOLD_RATIO = 2.0f;  // Onset at 6dB over background
+const float ONSET_MIN_LEVEL = 0.05f;       // Ignore anything quieter than this
+const float ONSET_REARM_RATIO = 0.5f;      // Re-arm below half the threshold
+const float ONSET_REFRACTORY_MS = 60.0f;   // Minimum time between onsets
+
+class OnsetDetector {
+ public:
+  void Init(float sample_rate) {
+    attack_ = Coefficient(ONSET_ATTACK_MS, sample_rate);
+    release_ = Coefficient(ONSET_RELEASE_MS, sample_rate);
+    background_ = Coefficient(ONSET_BACKGROUND_MS, sample_rate);
+    refractory_samples_ =
+        static_cast<uint32_t>(ONSET_REFRACTORY_MS * sample_rate / 1000.0f);
+    envelope_ = 0.0f;
+    background_level_ = 0.0f;
+    refractory_left_ = 0;
+    armed_ = true;
+  }
+
+  // Process one block; returns true and sets offset to the sample index if
+  // an onset was found (at most one per block)
+  bool Process(const float* in, size_t size, size_t* offset) {
+    bool found = false;
+    for (size_t i = 0; i < size; i++) {
+      float level = fabsf(in[i]);
+      float coefficient = level > envelope_ ? attack_ : release_;
+      envelope_ += coefficient * (level - envelope_);
+      background_level_ += background_ * (envelope_ - background_level_);
+
+      float threshold = background_level_ * ONSET_THRESHOLD_RATIO;
+      if (threshold < ONSET_MIN_LEVEL) threshold = ONSET_MIN_LEVEL;
+
+      if (refractory_left_ > 0) {
+        refractory_left_--;
+      } else if (armed_ && !found && envelope_ > threshold) {
+        *offset = i;
+        found = true;
+        armed_ = false;
+        refractory_left_ = refractory_samples_;
+      }
+      if (!armed_ && envelope_ < threshold * ONSET_REARM_RATIO) armed_ = true;
+    }
+    return found;
+  }
+
+ private:
+  // One-pole coefficient for a time constant in ms
+  static float Coefficient(float time_ms, float sample_rate) {
+    return 1.0f - expf(-1000.0f / (time_ms * sample_rate));
+  }
+
+  float attack_;
+  float release_;
+  float background_;
+  uint32_t refractory_samples_;
+  float envelope_;
+  float background_level_;
+  uint32_t refractory_left_;
+  bool armed_;
+};
+
+// Profiling
+// Sample-time measurements; the platform adds the cycle counts. Clock jitter
+// is only measured between edges the estimator took in a row, so a transport
+// gap, a restart or an outlier doesn't show up as jitter.
+Profile profile;                    // Written by the scheduler and controls
+uint32_t profile_last_edge = 0;     // Sample time of the previous clock edge
+bool profile_edge_tracked = false;  // The previous edge was in lock
+uint32_t step_ideal_sample = 0;     // Ideal sample time of the pending step
+
+// Arpeggiator state
+// Note and pattern state belongs to the control task, which computes the
+// steps ahead of time; gate_triggered is shared with AudioCallback
+float base_note_cv = 0.0f;         // CV input for base note (1V/octave)
+bool note_change_pending = false;  // Flag to indicate note change is waiting
+float bpm = 120.0f;                // Internal clock tempo
+volatile bool gate_triggered = false;  // Gate trigger flag
+int arp_step = 0;  // Step in arpeggio of the next step event computed (0-3)
+float beat_period_samples = 24000.0f;  // Internal clock beat period (samples)
+
+// Step scheduler state (advanced by AudioCallback, one block at a time)
+// Beat timing is a 32-bit fixed-point phase accumulator: one full turn
+// (2^32) is one beat, so a wrap is a beat boundary. Together with the beat
+// count it gives a 32.32 beat position, and the step position is that scaled
+// by the clock ratio, so multiplied and divided steps stay locked to the beat
+// grid. The per-sample increment is only recomputed when the tempo changes.
+// It is rounded to 32 more fraction bits, which are carried from block to
+// block, so the phase keeps to the period it was derived from to well under
+// a sample over a day of running.
+volatile uint32_t sample_clock = 0;        // Samples since audio start
+volatile uint32_t beat_increment = 0;      // Beat phase per sample
+uint32_t beat_increment_fraction = 0;      // Below beat_increment (2^-32)
+volatile uint32_t beat_phase = 0;          // Position within the beat
+uint32_t beat_phase_fraction = 0;          // Below beat_phase (2^-32)
+volatile uint32_t beat_count = 0;          // Beats since the last restart
+float clock_period_samples = 24000.0f;     // Beat period being followed
+uint32_t step_number = 0;                  // Step position of the last step
+int active_ratio = 0;                      // Clock ratio step_number is in
+volatile float step_samples = 24000.0f;    // Samples per step
+bool step_due = false;                     // Play a step on this block
+bool sequence_restart = false;             // Next step restarts the pattern
+uint32_t gate_off_sample = 0;              // Sample time the gate ends
+bool gate_held = false;                    // Gate stays high into next step
+bool gate_out_high = false;                // Current gate_out_1 state
+uint32_t gate2_off_sample = 0;             // Sample time gate_out_2 ends
+bool gate2_held = false;                   // gate_out_2 held into next step
+bool gate2_out_high = false;               // Current gate_out_2 state
+bool step_scheduled = false;               // Step boundary passed, grooved
+uint32_t step_fire_sample = 0;             // Sample time the step plays
+float step_interval = 24000.0f;            // Samples until the next step
+int step_ratchets = 1;                     // Gate hits in the current step
+int ratchet_hit = 0;                       // Hits played in the current step
+uint32_t ratchet_next_sample = 0;          // Sample time of the next hit
+bool step_gate = false;                    // Current step raises the gate
+
+// Step events
+// The control task computes the output of each step ahead of time and queues
+// it, so the scheduler only pops and writes when a step is due and output
+// latency does not depend on how much work a step takes to compute. Every
+// pattern restart starts a new sequence: step 0 is played from restart_cv,
+// which the control task keeps up to date, and queued events from the
+// previous sequence are dropped.
+const size_t STEP_EVENT_QUEUE_SIZE = 8;  // Must be a power of two
+const uint32_t STEP_LOOKAHEAD = 2;       // Steps computed ahead of playback
+
+struct StepEvent {
+  uint32_t sequence;  // Sequence the event was computed for
+  uint32_t step;      // Step within the sequence the event is due on
+  int pattern_step;   // Position in the pattern (arp_step)
+  float cv;           // CV_OUT_1 voltage (0-5V)
+  bool gate;          // Raise gate_out_1
+  uint8_t ratchets;   // Gate hits spread over the step (1 = single hit)
+  float cv2;          // CV_OUT_2 voltage (0-5V)
+  bool gate2;         // Raise gate_out_2
+};
+
+SpscQueue<StepEvent, STEP_EVENT_QUEUE_SIZE> step_events;
+volatile uint32_t sequence_id = 0;    // Current sequence (scheduler owned)
+volatile uint32_t sequence_step = 0;  // Steps played in current sequence
+float restart_cv = 0.0f;              // CV for step 0 of the next sequence
+uint8_t restart_ratchets = 1;         // Gate hits for that step 0
+float restart_cv2 = 0.0f;             // Second track CV for that step 0
+bool restart_gate2 = false;           // Second track gate for that step 0
+uint32_t producer_sequence = 0;       // Sequence being computed
+uint32_t producer_step = 0;           // Next step to compute
+volatile uint32_t step_grid_offset = 0;  // Step position minus sequence step
+Random pattern_random;                // Generator for random patterns
+
+// External clock capture
+// gate_in_1 is sampled at the start of every audio block and rising edges are
+// timestamped with the sample clock, so edges are never missed when the main
+// loop stalls and intervals are measured to one block instead of one ms.
+// Alternatively the left audio input is used as the clock through an onset
+// detector, or MIDI clock; all feed the same edge queue and tempo estimator.
+enum ClockSource {
+  CLOCK_SOURCE_GATE = 0,  // Rising edges on gate_in_1
+  CLOCK_SOURCE_AUDIO,     // Transients on the left audio input
+  CLOCK_SOURCE_MIDI,      // MIDI clock (ARP_MIDI builds)
+};
+
+const size_t CLOCK_EDGE_QUEUE_SIZE = 8;
+SpscQueue<uint32_t, CLOCK_EDGE_QUEUE_SIZE> clock_edges;  // Edge sample times
+volatile ClockSource external_clock_source = CLOCK_SOURCE_GATE;
+OnsetDetector audio_clock;                   // Onsets on the left audio input
+bool clock_in_prev = false;                  // gate_in_1 state on last block
+volatile bool clock_resync_pending = false;  // Forget the last clock edge
+TempoEstimator tempo;                        // Follows the captured edges
+
+// Internal clock state
+volatile bool internal_clock_enabled = false;  // Toggle for internal clock
+uint32_t last_internal_clock_time = 0;  // Time of last internal clock tick
+
+// Tap tempo
+// A short press of the button with the internal clock taps the tempo. Taps
+// are timestamped on the press and go through their own tempo estimator, so
+// a mistimed tap is rejected like a bad clock edge, and each accepted tap
+// sets the tempo and moves the beat grid onto the tap. A tap is only known
+// to be one on release (a longer press latches, and a shifted knob isn't a
+// tap), by which time its beat has passed, so the grid takes over from the
+// next step. The tempo knob takes over again once it is moved.
+const float TAP_LOCK_TIME_BEATS = 1.0f;  // Taps follow the median directly
+TempoEstimator tap_tempo;                // Follows the tapped beats
+uint32_t tap_press_sample = 0;           // Sample time of the last press
+uint32_t tap_last_sample = 0;            // Sample time of the last tap
+uint32_t tap_beat_sample = 0;            // Beat of the last accepted tap
+uint32_t tap_count = 0;                  // Accepted taps
+
+// gate_in_2 function
+// gate_in_2 either collects held notes for the note pool, resets the pattern
+// and the beat to a downbeat on each rising edge, acts as a run gate (the
+// rising edge resets and the outputs are silent while it is low) or recalls
+// the next preset on each rising edge. Resets are
+// captured and applied on the same audio block, and the external clock is
+// realigned to the reset so the edge that comes with it is on the beat.
+// Select the function at build time with ARP_GATE_IN_2_MODE.
+enum GateIn2Mode {
+  GATE_IN_2_NOTES = 0,  // Note pool gate for CV_5
+  GATE_IN_2_RESET,      // Reset trigger
+  GATE_IN_2_RUN,        // Run gate, reset on the rising edge
+  GATE_IN_2_PRESET,     // Next preset trigger
+};
+
+#ifndef ARP_GATE_IN_2_MODE
+#define ARP_GATE_IN_2_MODE GATE_IN_2_NOTES
+#endif
+
+const GateIn2Mode gate_in_2_mode = ARP_GATE_IN_2_MODE;  // gate_in_2 function
+bool reset_in_prev = false;              // gate_in_2 state on last block
+bool reset_edge = false;                 // Reset captured on this block
+volatile bool transport_running = true;  // Run gate high (or no run gate)
+
+// MIDI input
+// MIDI messages are read at the start of every audio block like gate_in_1,
+// parsed already by the platform (in the USB receive interrupt on the Patch
+// SM), so a clock tick is timestamped to the block it arrived in with no
+// allocation and at most one block of latency. As the clock source, every
+// MIDI_PPQN-th tick is a beat edge into the tempo estimator. Start restarts
+// the pattern on the next tick, which is the downbeat, Stop silences the
+// outputs and Continue carries on. Note on / off from any channel go to the
+// control task through midi_notes and into the held-note pool like notes on
+// gate_in_2, latch included.
+const uint32_t MIDI_PPQN = 24;            // Clock ticks per beat
+const size_t MIDI_NOTE_QUEUE_SIZE = 16;  // Must be a power of two
+
+struct MidiNote {
+  uint8_t note;  // MIDI note number
+  bool on;       // Note on (false for note off)
+};
+
+SpscQueue<MidiNote, MIDI_NOTE_QUEUE_SIZE> midi_notes;  // For the control task
+uint32_t midi_ticks = 0;            // Clock ticks since the last beat edge
+bool midi_start_pending = false;    // Next tick is the downbeat
+volatile bool midi_running = true;  // Not stopped by MIDI Stop
+
+// Clock rate
+// Steps per beat are a multiply and a power-of-two divide of the beat
+// position, selected with CV_3. Both clock modes step at this rate; an
+// external clock pulse is one beat.
+struct ClockRatio {
+  uint32_t multiply;      // Steps per beat before dividing
+  uint32_t divide_shift;  // log2 of the beats per step divider
+};
+
+const ClockRatio clock_ratios[] = {
+    {1, 3},   // 1/8
+    {1, 2},   // 1/4
+    {1, 1},   // 1/2
+    {1, 0},   // x1
+    {2, 0},   // x2
+    {3, 0},   // x3 (triplets)
+    {4, 0},   // x4
+    {6, 0},   // x6
+    {8, 0},   // x8
+    {12, 0},  // x12
+    {16, 0},  // x16
+};
+const int CLOCK_RATIO_COUNT =
+    sizeof(clock_ratios) / sizeof(clock_ratios[0]);
+const int CLOCK_RATIO_X1 = 3;  // clock_ratios index of one step per beat
+
+int clock_ratio_index = CLOCK_RATIO_X1;  // Selected ratio (CV_3)
+
+// Gate length
+// CV_4 sets the gate as a fraction of the step, with a fixed 10ms trigger at
+// the bottom of its range and legato at the top: the gate is held through
+// the next step so it is tied instead of retriggered. Gate-off is a timed
+// event in the scheduler, so pulse widths are exact to one audio block.
+enum GateMode {
+  GATE_MODE_TRIGGER = 0,  // Fixed GATE_PULSE_SAMPLES pulse
+  GATE_MODE_LENGTH,       // gate_fraction of the step
+  GATE_MODE_LEGATO,       // Held until the next step
+};
+
+const float GATE_TRIGGER_ZONE = 0.05f;  // Knob range giving a trigger
+const float GATE_LEGATO_ZONE = 0.95f;   // Knob position where legato starts
+const uint32_t GATE_MIN_SAMPLES = AUDIO_BLOCK_SIZE;  // Shortest gate
+// Gate low time before the next hit, so every hit is a new rising edge
+const uint32_t GATE_MIN_GAP_SAMPLES = 2 * AUDIO_BLOCK_SIZE;
+
+GateMode gate_mode = GATE_MODE_LENGTH;  // Selected gate mode (CV_4)
+float gate_fraction = 0.5f;             // Gate length (x step)
+
+// Groove
+// A groove delays steps by a percentage of a step, repeating every length
+// steps counted from the beat: swing delays every other step, and 16-step
+// templates shift each step of a bar of 16ths. The offsets and the
+// resulting step intervals are converted to samples whenever the tempo,
+// clock ratio or groove changes, so the scheduler only adds an offset to the
+// sample time of each step. Selected with K2 while holding the button.
+const int MAX_GROOVE_STEPS = 16;
+
+struct GrooveDef {
+  int length;                        // Steps per repeat (power of two)
+  int8_t offsets[MAX_GROOVE_STEPS];  // Delay of each step (% of a step)
+};
+
+// Straight steps with every other step delayed; 50% is straight, 66% is a
+// triplet feel
+constexpr GrooveDef Swing(int percent) {
+  GrooveDef groove{};
+  groove.length = 2;
+  groove.offsets[1] = 2 * (percent - 50);
+  return groove;
+}
+
+// Fixed list of step delays
+template <int L>
+constexpr GrooveDef GrooveSteps(const int (&offsets)[L]) {
+  GrooveDef groove{};
+  groove.length = L;
+  for (int i = 0; i < L; i++) groove.offsets[i] = offsets[i];
+  return groove;
+}
+
+// Groove table
+constexpr GrooveDef groove_table[] = {
+    Swing(50),  // Straight
+    Swing(54),
+    Swing(58),
+    Swing(62),
+    Swing(66),
+    Swing(71),
+    // Laid back: behind the beat, swung 16ths
+    GrooveSteps({0, 18, 6, 24, 2, 18, 8, 26, 0, 18, 6, 24, 2, 18, 8, 30}),
+    // Pushed: heavier swing on the second half of each beat
+    GrooveSteps({0, 10, 4, 34, 0, 10, 4, 34, 0, 10, 4, 34, 0, 12, 6, 38}),
+};
+const int GROOVE_COUNT = sizeof(groove_table) / sizeof(groove_table[0]);
+
+int groove_index = 0;                       // Selected groove
+int active_groove = 0;                      // Groove the scheduler plays
+uint32_t groove_offsets[MAX_GROOVE_STEPS];  // Step delays (samples)
+float groove_intervals[MAX_GROOVE_STEPS];   // Step to next step (samples)
+uint32_t groove_mask = 1;                   // Groove length - 1
+
+// Rhythm
+// Steps are thinned by a Euclidean gate mask, k hits spread as evenly as
+// possible over n steps and rotated, and then by a probability. The mask is
+// only regenerated when the rhythm or rotation changes, so the scheduler
+// pays one bit test and one random compare per step. A step that misses
+// leaves the gate low and the CV where it was, but still moves the pattern
+// on. The rhythm is selected with K3 and its rotation with K4 while holding
+// the button; CV_6 thins the remaining steps (0V plays all of them).
+const float PROBABILITY_DEAD_ZONE = 0.02f;  // CV_6 reading that thins nothing
+
+struct EuclideanRhythm {
+  int hits;   // Steps with a gate (k)
+  int steps;  // Steps before the rhythm repeats (n, at most 32)
+};
+
+const EuclideanRhythm rhythms[] = {
+    {1, 1},  {7, 8},   {5, 8},   {3, 8},   {3, 4},   {2, 3},   {5, 12},
+    {7, 12}, {5, 16},  {7, 16},  {9, 16},  {11, 16}, {13, 16},
+};
+const int RHYTHM_COUNT = sizeof(rhythms) / sizeof(rhythms[0]);
+
+int rhythm_index = 0;                   // Selected rhythm
+int rhythm_rotation = 0;                // Steps the mask is rotated by
+uint32_t rhythm_mask = 1;               // Bit n set if step n plays
+int rhythm_length = 1;                  // Steps in rhythm_mask
+uint32_t step_threshold = 0xffffffffu;  // Probability as a uint32
+int rhythm_step = 0;                    // Position in the rhythm
+
+// Scheduler parameters
+// Everything the control task sets for the scheduler goes across as one
+// snapshot: the control task fills the back buffer at the end of each pass
+// and flips params_front, and the scheduler copies the front buffer at the
+// start of each block. The audio interrupt preempts the control task and
+// never the other way round, so the copy can't be cut by a write and the
+// buffer being filled is never the one being read, without either side
+// disabling interrupts. Compiler fences keep the buffer writes before the
+// flip and the copy after reading it. Restarts and taps are request counts
+// inside the snapshot, so each is acted on with the settings it was made
+// with. The scheduler derives the beat increment, step length and groove
+// timing from the snapshot itself, so only it ever writes them.
+struct SchedulerParams {
+  float beat_period;          // Internal clock beat period (samples)
+  int clock_ratio_index;      // Selected clock ratio
+  int groove_index;           // Selected groove
+  bool groove_held;           // groove_index waits for the step below
+  uint32_t groove_sequence;   // Sequence of the step it starts on
+  uint32_t groove_step;       // Step within that sequence
+  GateMode gate_mode;         // Selected gate mode
+  float gate_fraction;        // Gate length (x step)
+  uint32_t rhythm_mask;       // Bit n set if step n plays
+  int rhythm_length;          // Steps in rhythm_mask
+  uint32_t step_threshold;    // Step probability as a uint32
+  float restart_cv;           // CV for step 0 of the next sequence
+  uint8_t restart_ratchets;   // Gate hits for that step 0
+  float restart_cv2;          // Second track CV for that step 0
+  bool restart_gate2;         // Second track gate for that step 0
+  uint32_t restarts;          // Restarts requested (internal clock start)
+  uint32_t step_resets;       // Restarts keeping the step grid
+  uint32_t bar_restarts;      // Restarts on the next bar line
+  uint32_t taps;              // Accepted taps
+  uint32_t tap_beat_sample;   // Beat of the last accepted tap
+};
+
+SchedulerParams params_buffer[2];    // Front and back snapshots
+volatile int params_front = 0;       // Snapshot the scheduler copies
+SchedulerParams params;              // Scheduler's copy for this block
+uint32_t restart_requests = 0;       // Internal clock starts
+uint32_t step_reset_requests = 0;    // Restarts keeping the step grid
+uint32_t bar_restart_requests = 0;   // Restarts on the next bar line
+bool bar_restart_armed = false;      // Restart pattern on next bar
+Random rhythm_random;                            // Step probability generator
+
+// Scale library
+// Each scale is a 12-bit mask of pitch classes above the root plus a snap
+// table, built at compile time, giving the offset from every pitch class to
+// the nearest one in the scale (ties go down). Quantizing a note is one
+// table lookup.
+enum ArpScale {
+  SCALE_IONIAN = 0,  // Major
+  SCALE_DORIAN,      // Minor, raised 6th
+  SCALE_LYDIAN,      // Major, raised 4th
+  SCALE_MIXOLYDIAN,  // Major, flat 7th
+  SCALE_AEOLIAN,     // Natural minor
+  SCALE_LOCRIAN,     // Minor, flat 2nd and 5th
+  SCALE_WHOLE_TONE,  // Whole steps
+  SCALE_DIMINISHED,  // Whole step / half step
+  ARP_SCALE_COUNT    // Total number of scales
+};
+
+struct ScaleDef {
+  uint16_t mask;    // Bit n set if n semitones above the root is in the scale
+  int8_t snap[12];  // Offset to the nearest scale note for each pitch class
+};
+
+constexpr bool ScaleHas(uint16_t mask, int pitch_class) {
+  return (mask >> ((pitch_class + 12) % 12)) & 1;
+}
+
+constexpr ScaleDef Scale(uint16_t mask) {
+  ScaleDef scale{};
+  scale.mask = mask;
+  for (int pc = 0; pc < 12; pc++) {
+    int offset = 0;
+    while (!ScaleHas(mask, pc - offset) && !ScaleHas(mask, pc + offset)) {
+      offset++;
+    }
+    scale.snap[pc] = ScaleHas(mask, pc - offset) ? -offset : offset;
+  }
+  return scale;
+}
+
+// The ionian mask rotated to start on its nth degree
+constexpr uint16_t Mode(int degree) {
+  uint16_t ionian = 0xab5;  // 0, 2, 4, 5, 7, 9, 11
+  int shift = 0;
+  for (int i = 0, found = 0; found < degree; i++) {
+    if ((ionian >> (i + 1)) & 1) {
+      found++;
+      shift = i + 1;
+    }
+  }
+  return ((ionian >> shift) | (ionian << (12 - shift))) & 0xfff;
+}
+
+// Scale table, in ArpScale order
+constexpr ScaleDef scale_table[] = {
+    Scale(Mode(0)),  // IONIAN
+    Scale(Mode(1)),  // DORIAN
+    Scale(Mode(3)),  // LYDIAN
+    Scale(Mode(4)),  // MIXOLYDIAN
+    Scale(Mode(5)),  // AEOLIAN
+    Scale(Mode(6)),  // LOCRIAN
+    Scale(0x555),    // WHOLE_TONE
+    Scale(0xb6d),    // DIMINISHED
+};
+static_assert(sizeof(scale_table) / sizeof(scale_table[0]) == ARP_SCALE_COUNT,
+              "scale_table must have one entry per ArpScale");
+
+// Chord library
+// Each chord lists its intervals over every chord index a pattern step can
+// use, repeating an octave up past the chord's own notes, so a step only
+// indexes the table. Every chord carries the scale the output is quantized
+// to. The selected chord is a pointer into chord_table, so switching chords
+// is a pointer swap.
+const int CHORD_TABLE_SIZE = 16;  // Chord indices (one per pattern step)
+
+enum ArpChord {
+  CHORD_DOM7 = 0,    // 1, 3, 5, b7
+  CHORD_MAJOR,       // 1, 3, 5
+  CHORD_MINOR,       // 1, b3, 5
+  CHORD_SUS2,        // 1, 2, 5
+  CHORD_SUS4,        // 1, 4, 5
+  CHORD_7SUS4,       // 1, 4, 5, b7
+  CHORD_MAJ7,        // 1, 3, 5, 7
+  CHORD_MIN7,        // 1, b3, 5, b7
+  CHORD_MIN7B5,      // 1, b3, b5, b7
+  CHORD_DIMINISHED,  // 1, b3, b5
+  CHORD_DIM7,        // 1, b3, b5, bb7
+  CHORD_AUGMENTED,   // 1, 3, #5
+  CHORD_MAJ9,        // 1, 3, 5, 7, 9
+  CHORD_DOM9,        // 1, 3, 5, b7, 9
+  CHORD_MIN9,        // 1, b3, 5, b7, 9
+  ARP_CHORD_COUNT    // Total number of chords
+};
+
+struct ChordDef {
+  int size;                            // Notes before repeating an octave up
+  ArpScale scale;                      // Scale the output is quantized to
+  int8_t intervals[CHORD_TABLE_SIZE];  // Semitones above the root per index
+};
+
+template <int N>
+constexpr ChordDef Chord(const int (&notes)[N], ArpScale scale) {
+  ChordDef chord{};
+  chord.size = N;
+  chord.scale = scale;
+  for (int i = 0; i < CHORD_TABLE_SIZE; i++) {
+    chord.intervals[i] = notes[i % N] + 12 * (i / N);
+  }
+  return chord;
+}
+
+// Chord table, in ArpChord order
+constexpr ChordDef chord_table[] = {
+    Chord({0, 4, 7, 10}, SCALE_MIXOLYDIAN),      // DOM7
+    Chord({0, 4, 7}, SCALE_IONIAN),              // MAJOR
+    Chord({0, 3, 7}, SCALE_AEOLIAN),             // MINOR
+    Chord({0, 2, 7}, SCALE_IONIAN),              // SUS2
+    Chord({0, 5, 7}, SCALE_MIXOLYDIAN),          // SUS4
+    Chord({0, 5, 7, 10}, SCALE_MIXOLYDIAN),      // 7SUS4
+    Chord({0, 4, 7, 11}, SCALE_LYDIAN),          // MAJ7
+    Chord({0, 3, 7, 10}, SCALE_DORIAN),          // MIN7
+    Chord({0, 3, 6, 10}, SCALE_LOCRIAN),         // MIN7B5
+    Chord({0, 3, 6}, SCALE_LOCRIAN),             // DIMINISHED
+    Chord({0, 3, 6, 9}, SCALE_DIMINISHED),       // DIM7
+    Chord({0, 4, 8}, SCALE_WHOLE_TONE),          // AUGMENTED
+    Chord({0, 4, 7, 11, 14}, SCALE_IONIAN),      // MAJ9
+    Chord({0, 4, 7, 10, 14}, SCALE_MIXOLYDIAN),  // DOM9
+    Chord({0, 3, 7, 10, 14}, SCALE_DORIAN),      // MIN9
+};
+static_assert(sizeof(chord_table) / sizeof(chord_table[0]) == ARP_CHORD_COUNT,
+              "chord_table must have one entry per ArpChord");
+
+// Current chord (CV_8)
+ArpChord current_chord_index = CHORD_DOM7;
+const ChordDef* current_chord = &chord_table[CHORD_DOM7];
+
+// Arpeggio pattern types
+enum ArpPattern {
+  ARP_UP = 0,          // 0, 1, 2, 3 (n steps)
+  ARP_DOWN,            // 3, 2, 1, 0 (n steps)
+  ARP_UP_DOWN,         // 0, 1, 2, 3, 2, 1 (2n - 2 steps, smooth bounce)
+  ARP_DOWN_UP,         // 3, 2, 1, 0, 1, 2 (2n - 2 steps, smooth bounce)
+  ARP_RANDOM,          // Random order (n steps)
+  ARP_1_3_2_4,         // 0, 2, 1, 3, 2, 4 ... (broken thirds)
+  ARP_CONVERGE,        // 0, 3, 1, 2 (n steps, outside in)
+  ARP_RANDOM_LOCKED,   // Random order, same every pattern cycle (n steps)
+  ARP_UP_RATCHET,      // 0, 1, 2, 3 with the top note ratcheted (n steps)
+  ARP_BOUNCE_RATCHET,  // 0, 1, 2, 3, 2, 1 with a roll on the top note
+  ARP_AS_PLAYED,       // Held notes in the order played (n steps)
+  ARP_PATTERN_COUNT    // Total number of patterns
+};
+
+// Pattern definitions
+// Each pattern is a list of chord indices, built by the generators below for
+// the n notes being played: the held notes, or without any the notes of the
+// chord, so a triad arpeggiates 3 notes and a 9th chord 5. The control task
+// builds the current pattern whenever the notes, chord or pattern change.
+// Adding a pattern only needs an enum entry and a pattern_table entry. Steps
+// can be ratcheted: the gate is hit several times, evenly spaced, within the
+// step.
+const int MAX_PATTERN_NOTES = 16;  // Most notes a pattern runs over
+const int MAX_PATTERN_STEPS = 2 * MAX_PATTERN_NOTES - 2;  // Up/down over 16
+
+struct PatternDef {
+  int length;                           // Steps before the pattern repeats
+  bool random;                          // Pick a random step each step
+  bool locked;                          // Reseed at step 0 to repeat the order
+  bool as_played;                       // Held notes in play order, not pitch
+  uint32_t seed;                        // Seed for locked random patterns
+  int8_t steps[MAX_PATTERN_STEPS];      // Chord index for each step
+  uint8_t ratchets[MAX_PATTERN_STEPS];  // Gate hits per step (0 = one)
+};
+
+// 0, 1, ..., n-1
+constexpr PatternDef PatternUp(int n) {
+  PatternDef pattern{};
+  pattern.length = n;
+  for (int i = 0; i < n; i++) pattern.steps[i] = i;
+  return pattern;
+}
+
+// n-1, ..., 1, 0
+constexpr PatternDef PatternDown(int n) {
+  PatternDef pattern{};
+  pattern.length = n;
+  for (int i = 0; i < n; i++) pattern.steps[i] = n - 1 - i;
+  return pattern;
+}
+
+// Up then back down without repeating the end notes: 0, ..., n-1, ..., 1
+constexpr PatternDef PatternUpDown(int n) {
+  if (n < 2) return PatternUp(n);
+  PatternDef pattern{};
+  pattern.length = 2 * n - 2;
+  for (int i = 0; i < n; i++) pattern.steps[i] = i;
+  for (int i = 1; i < n - 1; i++) pattern.steps[n - 1 + i] = n - 1 - i;
+  return pattern;
+}
+
+// Down then back up without repeating the end notes: n-1, ..., 0, ..., n-2
+constexpr PatternDef PatternDownUp(int n) {
+  if (n < 2) return PatternDown(n);
+  PatternDef pattern{};
+  pattern.length = 2 * n - 2;
+  for (int i = 0; i < n; i++) pattern.steps[i] = n - 1 - i;
+  for (int i = 1; i < n - 1; i++) pattern.steps[n - 1 + i] = i;
+  return pattern;
+}
+
+// Outside in: 0, n-1, 1, n-2, ...
+constexpr PatternDef PatternConverge(int n) {
+  PatternDef pattern{};
+  pattern.length = n;
+  for (int i = 0; i < n; i++) {
+    pattern.steps[i] = (i % 2) ? n - 1 - i / 2 : i / 2;
+  }
+  return pattern;
+}
+
+// Random chord note each step
+constexpr PatternDef PatternRandom(int n) {
+  PatternDef pattern = PatternUp(n);
+  pattern.random = true;
+  return pattern;
+}
+
+// Random chord note each step, replaying the same order every cycle
+constexpr PatternDef PatternRandomLocked(int n, uint32_t seed) {
+  PatternDef pattern = PatternRandom(n);
+  pattern.locked = true;
+  pattern.seed = seed;
+  return pattern;
+}
+
+// 0, 1, ..., n-1 over the held notes in the order they were played
+constexpr PatternDef PatternAsPlayed(int n) {
+  PatternDef pattern = PatternUp(n);
+  pattern.as_played = true;
+  return pattern;
+}
+
+// Broken thirds, each note and the one two above it: 0, 2, 1, 3, 2, 4, ...
+// up to the top note, and at least up to index 3 (the octave of a triad)
+constexpr PatternDef PatternThirds(int n) {
+  PatternDef pattern{};
+  int pairs = n > 4 ? n - 2 : 2;
+  pattern.length = 2 * pairs;
+  for (int i = 0; i < pairs; i++) {
+    pattern.steps[2 * i] = i;
+    pattern.steps[2 * i + 1] = i + 2;
+  }
+  return pattern;
+}
+
+// Ratchet one step of a pattern into a number of gate hits
+constexpr PatternDef WithRatchet(PatternDef pattern, int step, int hits) {
+  pattern.ratchets[step] = hits;
+  return pattern;
+}
+
+// Random order over n notes, the same every cycle
+constexpr PatternDef PatternLockedOrder(int n) {
+  return PatternRandomLocked(n, 0xec1b2724u);
+}
+
+// Up with the top note ratcheted
+constexpr PatternDef PatternUpRatchet(int n) {
+  return WithRatchet(PatternUp(n), n - 1, 3);
+}
+
+// Up and down with a roll on the top note
+constexpr PatternDef PatternBounceRatchet(int n) {
+  return WithRatchet(PatternUpDown(n), n - 1, 4);
+}
+
+// Pattern table, in ArpPattern order: the generator of each pattern
+typedef PatternDef (*PatternGenerator)(int n);
+
+constexpr PatternGenerator pattern_table[] = {
+    PatternUp,             // UP
+    PatternDown,           // DOWN
+    PatternUpDown,         // UP_DOWN
+    PatternDownUp,         // DOWN_UP
+    PatternRandom,         // RANDOM
+    PatternThirds,         // 1_3_2_4
+    PatternConverge,       // CONVERGE
+    PatternLockedOrder,    // RANDOM_LOCKED
+    PatternUpRatchet,      // UP_RATCHET
+    PatternBounceRatchet,  // BOUNCE_RATCHET
+    PatternAsPlayed,       // AS_PLAYED
+};
+static_assert(sizeof(pattern_table) / sizeof(pattern_table[0]) ==
+                  ARP_PATTERN_COUNT,
+              "pattern_table must have one entry per ArpPattern");
+
+// Function to check that the order a locked random pattern repeats over n
+// notes is not just one of the fixed patterns of the same length
+constexpr bool LockedOrderIsNew(int n) {
+  PatternDef locked = pattern_table[ARP_RANDOM_LOCKED](n);
+  int8_t order[MAX_PATTERN_STEPS] = {};
+  Random random;
+  random.Seed(locked.seed);
+  for (int i = 0; i < locked.length; i++) {
+    order[i] = random.Below(locked.length);
+  }
+  for (PatternGenerator generator : pattern_table) {
+    PatternDef def = generator(n);
+    if (def.random || def.length != locked.length) continue;
+    bool same = true;
+    for (int i = 0; i < def.length; i++) {
+      if (def.steps[i] != order[i]) same = false;
+    }
+    if (same) return false;
+  }
+  return true;
+}
+static_assert(LockedOrderIsNew(3) && LockedOrderIsNew(4) &&
+                  LockedOrderIsNew(5),
+              "RANDOM_LOCKED seed must not repeat a fixed pattern");
+
+// Current pattern, built for the notes being played
+ArpPattern current_pattern = ARP_UP;
+PatternDef pattern_def = PatternUp(4);
+int pattern_length = 4;
+
+// Octave range
+// The pattern is played once per octave pass, going up, down or bouncing
+// over 1-4 octaves, and the whole sequence is transposed by CV_7. The range
+// is selected with K1 while holding the button.
+enum OctaveMode {
+  OCTAVE_UP = 0,  // Lowest octave first
+  OCTAVE_DOWN,    // Highest octave first
+  OCTAVE_BOUNCE,  // Up then back down without repeating the ends
+};
+
+struct OctaveRange {
+  int octaves;      // Octaves covered (1-4)
+  OctaveMode mode;  // Order of the octave passes
+};
+
+const OctaveRange octave_ranges[] = {
+    {1, OCTAVE_UP},     {2, OCTAVE_UP},     {3, OCTAVE_UP},
+    {4, OCTAVE_UP},     {2, OCTAVE_DOWN},   {3, OCTAVE_DOWN},
+    {4, OCTAVE_DOWN},   {2, OCTAVE_BOUNCE}, {3, OCTAVE_BOUNCE},
+    {4, OCTAVE_BOUNCE},
+};
+const int OCTAVE_RANGE_COUNT =
+    sizeof(octave_ranges) / sizeof(octave_ranges[0]);
+const int MAX_OCTAVE_PASSES = 6;  // Passes of a 4-octave bounce
+
+int octave_range_index = 0;  // Selected octave range
+int transpose = 0;           // Semitones added to every note (CV_7)
+
+// Second track
+// gate_out_2 and CV_OUT_2 play a second track derived from the main one: an
+// accent on the first step of every pattern cycle, a harmony voice one chord
+// note above the main note, or a copy of the main track playing every
+// TRACK2_DIVISION steps. Its gates and CVs travel in the same step events
+// as the main track, so both are written on the same block. Select the mode
+// at build time with ARP_TRACK2_MODE.
+enum Track2Mode {
+  TRACK2_OFF = 0,  // gate_out_2 / CV_OUT_2 unused
+  TRACK2_ACCENT,   // First step of each pattern cycle, main track CV
+  TRACK2_HARMONY,  // Every step, one chord note above the main track
+  TRACK2_DIVIDED,  // Every TRACK2_DIVISION steps, main track CV
+};
+
+#ifndef ARP_TRACK2_MODE
+#define ARP_TRACK2_MODE TRACK2_ACCENT
+#endif
+
+const uint32_t TRACK2_DIVISION = 2;  // Steps per divided second track step
+
+Track2Mode track2_mode = ARP_TRACK2_MODE;  // Second track mode
+
+// Glide
+// CV_OUT_1 can slide into a step instead of jumping: a linear ramp in volts,
+// so a constant rate in pitch, over ARP_GLIDE_PERCENT of the step. The
+// scheduler advances it once per audio block by an increment worked out
+// when the step starts from the step length at the current tempo, so a
+// glide costs an add and a DAC write per block. Gliding only into legato
+// steps, where the gate is held over from the step before, slides like a
+// 303; it can also glide into every step, or be off. Select the mode at
+// build time with ARP_GLIDE_MODE.
+enum GlideMode {
+  GLIDE_OFF = 0,  // Every step jumps
+  GLIDE_LEGATO,   // Glide into steps tied to the one before
+  GLIDE_ALWAYS,   // Glide into every step
+};
+
+#ifndef ARP_GLIDE_MODE
+#define ARP_GLIDE_MODE GLIDE_LEGATO
+#endif
+
+#ifndef ARP_GLIDE_PERCENT
+#define ARP_GLIDE_PERCENT 25
+#endif
+
+const GlideMode glide_mode = ARP_GLIDE_MODE;  // Steps that glide
+const float GLIDE_FRACTION = ARP_GLIDE_PERCENT / 100.0f;  // Glide time (x step)
+
+class Slew {
+ public:
+  // Jump straight to value
+  void Reset(float value) {
+    value_ = value;
+    target_ = value;
+    blocks_left_ = 0;
+  }
+
+  // Ramp from the current value to target over blocks calls to Process
+  void Start(float target, uint32_t blocks) {
+    if (blocks == 0) {
+      Reset(target);
+      return;
+    }
+    target_ = target;
+    increment_ = (target - value_) / blocks;
+    blocks_left_ = blocks;
+  }
+
+  // Advance one block; returns true if Value() changed, and the last block
+  // lands exactly on the target
+  bool Process() {
+    if (blocks_left_ == 0) return false;
+    value_ = --blocks_left_ == 0 ? target_ : value_ + increment_;
+    return true;
+  }
+
+  float Value() const { return value_; }
+
+ private:
+  float value_;
+  float target_;
+  float increment_;
+  uint32_t blocks_left_;
+};
+
+Slew cv_slew;  // CV_OUT_1 glide (scheduler owned)
+
+// Step buffer
+// The CV of every step of every octave pass is computed into step_cv when
+// the notes, chord, pattern, range or transpose change, so a step is one
+// read from the buffer however large the range. Random patterns pick a
+// step within the current pass.
+const int MAX_SEQUENCE_STEPS = MAX_PATTERN_STEPS * MAX_OCTAVE_PASSES;
+
+float step_cv[MAX_SEQUENCE_STEPS];  // CV_OUT_1 voltage of each step
+float harmony_cv[MAX_SEQUENCE_STEPS];  // Next chord note up of each step
+int sequence_length = 4;            // Steps in step_cv
+int pass_start = 0;                 // step_cv index of the current pass
+// Calibrated CV_OUT_1 voltage of every MIDI note, computed once at boot
+float note_cv_table[NOTE_COUNT];  // Calibrated CV_OUT_1 volts per MIDI note
+
+// Function to quantize CV to nearest semitone and return MIDI note number
+int QuantizeCvToNote(float cv_normalized) {
+  // cv_normalized is -1.0 to 1.0 representing -5V to 5V
+  // Convert to actual voltage
+  float cv_volts = cv_normalized * 5.0f;
+
+  // 1V/octave standard: C0 (MIDI 12) = 0.0833V (1/12 volt)
+  // This means 0V = B-1 (MIDI 11)
+  // Each semitone = 1/12 V = 0.0833V
+  // Formula: voltage = (midi_note - 11) / 12
+  // Inverse: midi_note = (voltage * 12) + 11
+  float note_float = cv_volts * 12.0f + 11.0f;  // Convert to MIDI note
+  return static_cast<int>(roundf(note_float));  // Quantize to nearest semitone
+}
+
+// Pitch input conditioning for CV_5
+// Readings are converted once to fixed-point semitones (Q8, 256 = 1
+// semitone), box-car averaged over the last PITCH_AVERAGE_SIZE readings and
+// quantized with a Schmitt-style window: the note only changes once the
+// average is PITCH_HYSTERESIS_Q8 past the halfway point to the next semitone.
+// Everything after the first conversion is integer only.
+const int PITCH_AVERAGE_SIZE = 8;     // Readings averaged (power of two)
+const int PITCH_AVERAGE_SHIFT = 3;    // log2(PITCH_AVERAGE_SIZE)
+const int32_t PITCH_HYSTERESIS_Q8 = 51;  // ~0.2 semitone past the midpoint
+
+class PitchQuantizer {
+ public:
+  void Init() {
+    initialized_ = false;
+    note_ = 0;
+  }
+
+  // Feed one CV reading (-1.0 to 1.0); returns true if the note changed
+  bool Process(float cv_normalized) {
+    // midi_note = (voltage * 12) + 11, in Q8: -5V..5V = +/-60 semitones
+    int32_t reading = static_cast<int32_t>(cv_normalized * (60.0f * 256.0f)) +
+                      11 * 256;
+
+    if (!initialized_) {
+      // Fill the window so the first note is right immediately
+      for (int i = 0; i < PITCH_AVERAGE_SIZE; i++) window_[i] = reading;
+      sum_ = reading * PITCH_AVERAGE_SIZE;
+      pos_ = 0;
+      note_ = QuantizeCvToNote(cv_normalized);
+      initialized_ = true;
+      return true;
+    }
+
+    sum_ += reading - window_[pos_];
+    window_[pos_] = reading;
+    pos_ = (pos_ + 1) & (PITCH_AVERAGE_SIZE - 1);
+    int32_t average = sum_ >> PITCH_AVERAGE_SHIFT;
+
+    // Distance from the centre of the current note
+    int32_t distance = average - note_ * 256;
+    if (distance < 128 + PITCH_HYSTERESIS_Q8 &&
+        distance > -128 - PITCH_HYSTERESIS_Q8) {
+      return false;
+    }
+    note_ = (average + 128) >> 8;  // Round to nearest semitone
+    return true;
+  }
+
+  int Note() const { return note_; }
+
+ private:
+  int32_t window_[PITCH_AVERAGE_SIZE];
+  int32_t sum_;
+  int pos_;
+  int note_;
+  bool initialized_;
+};
+
+// Conditioned CV_5 pitch input
+PitchQuantizer pitch_input;
+
+// Notes the arpeggio plays
+// Without held notes the pattern plays the CV_5 root through the current
+// chord. Changes are staged in pending_notes and only take effect at step 0
+// of the pattern (or at once when stopped), so a pattern cycle never mixes
+// old and new notes.
+const int MAX_HELD_NOTES = MAX_PATTERN_NOTES;  // Notes kept in the pool
+
+struct NoteSet {
+  int root;                       // Quantized CV_5 note (MIDI, C4 = 60)
+  int count;                      // Held notes (0 = use the chord)
+  int8_t sorted[MAX_HELD_NOTES];  // Held notes, lowest first
+  int8_t played[MAX_HELD_NOTES];  // Held notes, oldest first
+};
+
+// Held notes
+// Notes played on CV_5 + gate_in_2 are collected in a pool of up to
+// MAX_HELD_NOTES. A 128-bit set keeps the notes in pitch order and a linked
+// list indexed by note keeps them in the order played, so inserting and
+// removing a note are O(1) and neither order is ever sorted. When latched,
+// released notes stay in the pool and replaying one removes it.
+class NotePool {
+ public:
+  void Init() { Clear(); }
+
+  void Clear() {
+    for (int i = 0; i < 4; i++) held_[i] = 0;
+    head_ = NONE;
+    tail_ = NONE;
+    count_ = 0;
+  }
+
+  bool Contains(int note) const {
+    return (held_[note >> 5] >> (note & 31)) & 1;
+  }
+
+  // Add a note as the newest; the oldest note is dropped when full
+  void Insert(int note) {
+    if (Contains(note)) return;
+    if (count_ >= MAX_HELD_NOTES) Remove(head_);
+    held_[note >> 5] |= 1u << (note & 31);
+    prev_[note] = tail_;
+    next_[note] = NONE;
+    if (tail_ == NONE) {
+      head_ = note;
+    } else {
+      next_[tail_] = note;
+    }
+    tail_ = note;
+    count_++;
+  }
+
+  void Remove(int note) {
+    if (!Contains(note)) return;
+    held_[note >> 5] &= ~(1u << (note & 31));
+    if (prev_[note] == NONE) {
+      head_ = next_[note];
+    } else {
+      next_[prev_[note]] = next_[note];
+    }
+    if (next_[note] == NONE) {
+      tail_ = prev_[note];
+    } else {
+      prev_[next_[note]] = prev_[note];
+    }
+    count_--;
+  }
+
+  int Count() const { return count_; }
+
+  // Copy the held notes into a note set in both orders
+  void Fill(NoteSet* set) const {
+    int n = 0;
+    for (int word = 0; word < 4; word++) {
+      for (uint32_t bits = held_[word]; bits; bits &= bits - 1) {
+        set->sorted[n++] = word * 32 + __builtin_ctz(bits);
+      }
+    }
+    n = 0;
+    for (int note = head_; note != NONE; note = next_[note]) {
+      set->played[n++] = note;
+    }
+    set->count = count_;
+  }
+
+ private:
+  static const int NONE = -1;
+
+  uint32_t held_[4];         // Bit per MIDI note
+  int8_t next_[NOTE_COUNT];  // Next newer note in play order
+  int8_t prev_[NOTE_COUNT];  // Next older note in play order
+  int head_;                 // Oldest note
+  int tail_;                 // Newest note
+  int count_;
+};
+
+NotePool note_pool;                   // Notes held on CV_5 + gate_in_2
+NoteSet active_notes = {};            // Notes the pattern is playing
+NoteSet pending_notes = {};           // Notes for the next pattern cycle
+bool note_latch = false;              // Keep notes after their gate ends
+bool note_gate_prev = false;          // gate_in_2 state on last loop
+int note_gate_note = 0;               // Note captured on the gate rise
+bool note_gate_valid = false;         // note_gate_note is a MIDI note
+bool button_long_press = false;       // Button held past LATCH_HOLD_MS
+const float LATCH_HOLD_MS = 800.0f;   // Button hold that toggles the latch
+
+// Function to convert MIDI note to CV voltage (1V/octave)
+// Returns voltage value (not normalized)
+float NoteToCv(int midi_note) {
+  // 1V/octave standard: C0 (MIDI 12) = 0.0833V
+  // 0V = B-1 (MIDI 11)
+  return (midi_note - 11) / 12.0f;
+}
+
+// Function to convert MIDI note to calibrated, clamped CV_OUT_1 voltage
+float CalibratedNoteToCv(int midi_note, const CvCalibration& cal) {
+  float output_cv = NoteToCv(midi_note) * cal.scale + cal.offset;
+
+  // Clamp to valid DAC range
+  if (output_cv < 0.0f) output_cv = 0.0f;
+  if (output_cv > 5.0f) output_cv = 5.0f;
+  return output_cv;
+}
+
+// Function to build note_cv_table from the calibration (called once at boot)
+void BuildNoteCvTable(const CvCalibration& cal) {
+  for (int note = 0; note < NOTE_COUNT; note++) {
+    note_cv_table[note] = CalibratedNoteToCv(note, cal);
+  }
+}
+
+// Function to get the position in the pattern to play for a step
+// step must be less than the pattern length; callers advance it with a
+// compare-and-reset instead of a modulo
+// Random patterns draw from the given generator; locked ones reseed it at
+// step 0 so every cycle repeats the same order.
+int GetPatternPosition(const PatternDef& def, int step, Random& random) {
+  if (def.locked && step == 0) random.Seed(def.seed);
+  return def.random ? random.Below(def.length) : step;
+}
+
+// Function to get the number of gate hits for a step of a pattern
+int GetPatternRatchets(const PatternDef& def, int step) {
+  int hits = def.ratchets[step];
+  return hits > 1 ? hits : 1;
+}
+
+// CV input filtering
+// With ARP_CV_FILTER (the default) CV_1 to CV_8 are sampled straight from the
+// ADC DMA buffer on every audio block rather than once per control pass.
+// Samples go into a double buffer of two halves of CV_DECIMATION blocks, and
+// each time a half fills, both halves go through a Hann-windowed sinc
+// low-pass, so every input gets one clean value per control period. All
+// inputs are filtered over the same window, so their values are time
+// aligned, with a fixed group delay of (CV_FILTER_TAPS - 1) / 2 blocks
+// (about 1ms). The filter runs in the audio callback and the control task
+// takes a copy of the latest values at the start of each pass. Build with
+// ARP_CV_FILTER=0 to read the processed ADC values once per pass instead.
+#ifndef ARP_CV_FILTER
+#define ARP_CV_FILTER 1
+#endif
+
+const int CV_INPUTS = 8;  // CV_1 to CV_8
+// Audio blocks per filtered value (one control period)
+const int CV_DECIMATION =
+    static_cast<int>(SAMPLE_RATE) / AUDIO_BLOCK_SIZE / CONTROL_RATE_HZ > 0
+        ? static_cast<int>(SAMPLE_RATE) / AUDIO_BLOCK_SIZE / CONTROL_RATE_HZ
+        : 1;
+const int CV_FILTER_TAPS = 2 * CV_DECIMATION;  // Both halves of the buffer
+const float CV_FILTER_CUTOFF_HZ = 250.0f;      // Low-pass cutoff
+
+class CvFilter {
+ public:
+  // cutoff is a fraction of the rate samples are added at
+  void Init(float cutoff) {
+    const float pi = 3.14159265f;
+    float sum = 0.0f;
+    for (int i = 0; i < CV_FILTER_TAPS; i++) {
+      // The tap count is even, so t is never 0
+      float t = i - (CV_FILTER_TAPS - 1) * 0.5f;
+      float window = 0.5f - 0.5f * cosf(2.0f * pi * (i + 0.5f) /
+                                        CV_FILTER_TAPS);
+      taps_[i] = sinf(2.0f * pi * cutoff * t) / (pi * t) * window;
+      sum += taps_[i];
+    }
+    for (int i = 0; i < CV_FILTER_TAPS; i++) taps_[i] /= sum;  // Unity gain
+    pos_ = 0;
+    published_ = 0;
+    primed_ = false;
+  }
+
+  // Add one sample of every input; filters and publishes when a half of the
+  // buffer fills
+  void Process(const float* samples) {
+    if (!primed_) {
+      // Fill the buffer so the first values are right immediately
+      for (int input = 0; input < CV_INPUTS; input++) {
+        for (int i = 0; i < CV_FILTER_TAPS; i++) {
+          buffer_[input][i] = samples[input];
+        }
+        values_[published_][input] = samples[input];
+      }
+      primed_ = true;
+    }
+    for (int input = 0; input < CV_INPUTS; input++) {
+      buffer_[input][pos_] = samples[input];
+    }
+    if (++pos_ == CV_FILTER_TAPS) pos_ = 0;
+    if (pos_ % CV_DECIMATION != 0) return;
+
+    // pos_ is now the start of the older half, so the oldest sample
+    int next = published_ ^ 1;
+    for (int input = 0; input < CV_INPUTS; input++) {
+      const float* buffer = buffer_[input];
+      float sum = 0.0f;
+      int index = pos_;
+      for (int i = 0; i < CV_FILTER_TAPS; i++) {
+        sum += taps_[i] * buffer[index];
+        if (++index == CV_FILTER_TAPS) index = 0;
+      }
+      values_[next][input] = sum;
+    }
+    published_ = next;
+  }
+
+  // Copy the latest values of all inputs; a new set is published at most
+  // once per CV_DECIMATION blocks, so the copy is never torn
+  void Read(float* values) const {
+    const float* latest = values_[published_];
+    for (int input = 0; input < CV_INPUTS; input++) {
+      values[input] = latest[input];
+    }
+  }
+
+ private:
+  float taps_[CV_FILTER_TAPS];
+  float buffer_[CV_INPUTS][CV_FILTER_TAPS];
+  float values_[2][CV_INPUTS];
+  volatile int published_;
+  int pos_;
+  bool primed_;
+};
+
+CvFilter cv_filter;            // CV_1 to CV_8, filtered in AudioCallback
+float cv_readings[CV_INPUTS];  // Inputs for the current control pass
+
+// Control smoothing
+// Knob / CV readings go through a one-pole low-pass and a hysteresis band:
+// the held value only moves (and Process() only reports a change) once the
+// smoothed reading has moved more than the band, so downstream logic runs on
+// real changes instead of on every control tick.
+const float CONTROL_SMOOTHING = 0.1f;     // One-pole coefficient per reading
+const float CONTROL_HYSTERESIS = 0.004f;  // Band around the held value
+const float SEGMENT_HYSTERESIS = 0.02f;   // Extra margin past segment edges
+const float CONTROL_CATCH = 0.02f;        // Pickup window after Catch()
+const float TRANSPOSE_HYSTERESIS = 0.2f;  // Semitones past the midpoint
+
+class SmoothedControl {
+ public:
+  void Init(float coefficient, float hysteresis) {
+    coefficient_ = coefficient;
+    hysteresis_ = hysteresis;
+    initialized_ = false;
+    catching_ = false;
+  }
+
+  // Start from a held value instead of the first reading
+  void SetValue(float value) {
+    smoothed_ = value;
+    value_ = value;
+    initialized_ = true;
+  }
+
+  // Stop reporting changes until the knob comes back to the held value
+  // (within CONTROL_CATCH, or crossing it), so a knob shared between two
+  // functions picks up where it was left instead of jumping
+  void Catch() {
+    if (!initialized_) return;
+    catching_ = true;
+    catch_side_ = 0;
+  }
+
+  // Feed one reading; returns true if Value() changed
+  bool Process(float reading) {
+    if (!initialized_) {
+      smoothed_ = reading;
+      value_ = reading;
+      initialized_ = true;
+      return true;
+    }
+    if (catching_) {
+      // Follow the knob directly so smoothing can't sweep past the value
+      smoothed_ = reading;
+      float offset = reading - value_;
+      int side = offset > 0.0f ? 1 : -1;
+      if ((offset < CONTROL_CATCH && offset > -CONTROL_CATCH) ||
+          (catch_side_ != 0 && side != catch_side_)) {
+        catching_ = false;
+      } else {
+        catch_side_ = side;
+      }
+      return false;
+    }
+    smoothed_ += coefficient_ * (reading - smoothed_);
+    float delta = smoothed_ - value_;
+    if (delta < hysteresis_ && delta > -hysteresis_) return false;
+    value_ = smoothed_;
+    return true;
+  }
+
+  float Value() const { return value_; }
+
+ private:
+  float coefficient_;
+  float hysteresis_;
+  float smoothed_;
+  float value_;
+  bool initialized_;
+  bool catching_;
+  int catch_side_;  // Side of the held value the knob was on (0 = unknown)
+};
+
+// Smoothed knob inputs (CV_5 pitch goes through pitch_input instead)
+SmoothedControl pattern_control;      // CV_1
+SmoothedControl tempo_control;        // CV_2
+SmoothedControl rate_control;         // CV_3
+SmoothedControl gate_control;         // CV_4
+SmoothedControl chord_control;        // CV_8
+SmoothedControl groove_control;       // CV_2 while holding the button
+SmoothedControl octave_control;       // CV_1 while holding the button
+SmoothedControl rhythm_control;       // CV_3 while holding the button
+SmoothedControl rotation_control;     // CV_4 while holding the button
+SmoothedControl transpose_control;    // CV_7
+SmoothedControl probability_control;  // CV_6
+bool shift_used = false;              // A knob was shifted during this press
+
+// Function to select one of count equal segments of a knob / CV input
+// The current segment is kept until the input is SEGMENT_HYSTERESIS past its
+// edge, so a knob parked on a boundary can't flip between segments.
+int SelectSegment(float cv_normalized, int current, int count) {
+  // CV inputs return -1.0 to 1.0 for bipolar (-5V to +5V)
+  // But pots on Patch.init() are wired 0-5V, so we get roughly 0.0 to 1.0
+  // Map the input range to 0.0 to 1.0 for segment selection
+  float cv_0_to_1;
+  if (cv_normalized < 0.0f) {
+    // Handle any negative values (bipolar CV input)
+    cv_0_to_1 = (cv_normalized + 1.0f) / 2.0f;
+  } else {
+    // Pot gives 0.0 to 1.0 range directly
+    cv_0_to_1 = cv_normalized;
+  }
+
+  // Clamp to 0-1 range
+  if (cv_0_to_1 < 0.0f) cv_0_to_1 = 0.0f;
+  if (cv_0_to_1 > 1.0f) cv_0_to_1 = 1.0f;
+
+  // Stay on the current segment while inside its widened range
+  float segment = 1.0f / count;
+  float low = current * segment - SEGMENT_HYSTERESIS;
+  float high = (current + 1) * segment + SEGMENT_HYSTERESIS;
+  if (cv_0_to_1 >= low && cv_0_to_1 < high) return current;
+
+  // Divide range into equal segments
+  int index = static_cast<int>(cv_0_to_1 * count);
+
+  // Clamp to valid range
+  if (index >= count) index = count - 1;
+
+  return index;
+}
+
+// Function to select pattern based on CV_1 input
+ArpPattern SelectPattern(float cv_normalized, ArpPattern current) {
+  return static_cast<ArpPattern>(
+      SelectSegment(cv_normalized, current, ARP_PATTERN_COUNT));
+}
+
+// Function to select the clock ratio based on CV_3 input
+int SelectClockRatio(float cv_normalized, int current) {
+  return SelectSegment(cv_normalized, current, CLOCK_RATIO_COUNT);
+}
+
+// Function to select the chord based on CV_8 input
+// CV_8 is a jack rather than a pot, so it is read as 0-5V and negative
+// voltages (or an unpatched jack reading just below 0V) select the first
+// chord instead of wrapping to the middle of the range.
+ArpChord SelectChord(float cv_normalized, ArpChord current) {
+  if (cv_normalized < 0.0f) cv_normalized = 0.0f;
+  return static_cast<ArpChord>(
+      SelectSegment(cv_normalized, current, ARP_CHORD_COUNT));
+}
+
+// Function to set the gate mode and length based on CV_4 input
+void SetGateLength(float cv_normalized) {
+  // Handle pot (0 to 1) or bipolar CV (-1 to +1)
+  float cv_0_to_1 =
+      cv_normalized < 0.0f ? (cv_normalized + 1.0f) / 2.0f : cv_normalized;
+  if (cv_0_to_1 < GATE_TRIGGER_ZONE) {
+    gate_mode = GATE_MODE_TRIGGER;
+  } else if (cv_0_to_1 >= GATE_LEGATO_ZONE) {
+    gate_mode = GATE_MODE_LEGATO;
+  } else {
+    gate_mode = GATE_MODE_LENGTH;
+    gate_fraction = cv_0_to_1;
+  }
+}
+
+// Function to select the octave range based on CV_1 input (button held)
+int SelectOctaveRange(float cv_normalized, int current) {
+  return SelectSegment(cv_normalized, current, OCTAVE_RANGE_COUNT);
+}
+
+// Function to select the rhythm based on CV_3 input (button held)
+int SelectRhythm(float cv_normalized, int current) {
+  return SelectSegment(cv_normalized, current, RHYTHM_COUNT);
+}
+
+// Function to select the rhythm rotation based on CV_4 input (button held)
+int SelectRotation(float cv_normalized, int current) {
+  return SelectSegment(cv_normalized, current, rhythms[rhythm_index].steps);
+}
+
+// Function to build the gate mask of k hits over n steps, rotated right
+// Step i is a hit when (i * k) mod n < k, which spreads the hits as evenly
+// as Bjorklund's algorithm and starts on a hit.
+uint32_t EuclideanMask(int hits, int steps, int rotation) {
+  uint32_t mask = 0;
+  for (int i = 0; i < steps; i++) {
+    if ((i * hits) % steps < hits) mask |= 1u << ((i + rotation) % steps);
+  }
+  return mask;
+}
+
+// Function to regenerate the rhythm mask (called from the control task when
+// the rhythm or rotation changes)
+void UpdateRhythm() {
+  const EuclideanRhythm& rhythm = rhythms[rhythm_index];
+  if (rhythm_rotation >= rhythm.steps) rhythm_rotation = 0;
+  rhythm_mask = EuclideanMask(rhythm.hits, rhythm.steps, rhythm_rotation);
+  rhythm_length = rhythm.steps;
+}
+
+// Function to set the step probability based on CV_6 input
+// Readings inside PROBABILITY_DEAD_ZONE play every step, so an unpatched jack
+// never drops one.
+void SetStepProbability(float cv_normalized) {
+  if (cv_normalized < PROBABILITY_DEAD_ZONE) {
+    step_threshold = 0xffffffffu;
+    return;
+  }
+  float thinning = cv_normalized > 1.0f ? 1.0f : cv_normalized;
+  // Largest float below 2^32, so the conversion can't overflow
+  step_threshold = static_cast<uint32_t>((1.0f - thinning) * 4294967040.0f);
+}
+
+// Function to select the groove based on CV_2 input (button held)
+int SelectGroove(float cv_normalized, int current) {
+  return SelectSegment(cv_normalized, current, GROOVE_COUNT);
+}
+
+// Function to convert the selected groove to sample offsets and step
+// intervals for the current step length
+void UpdateGroove() {
+  const GrooveDef& groove = groove_table[active_groove];
+  float percent_samples = step_samples / 100.0f;
+  for (int i = 0; i < groove.length; i++) {
+    groove_offsets[i] =
+        static_cast<uint32_t>(groove.offsets[i] * percent_samples);
+  }
+  for (int i = 0; i < groove.length; i++) {
+    int next = (i + 1) & (groove.length - 1);
+    groove_intervals[i] = step_samples + (groove.offsets[next] -
+                                          groove.offsets[i]) * percent_samples;
+  }
+  groove_mask = groove.length - 1;
+}
+
+// Function to derive the beat increment, step length and groove timing from
+// a beat period in samples (called from the scheduler, only when the tempo,
+// clock ratio or groove changes)
+void SetBeatPeriod(float period_samples) {
+  uint64_t increment = static_cast<uint64_t>(
+      18446744073709551616.0 / static_cast<double>(period_samples) + 0.5);
+  beat_increment = static_cast<uint32_t>(increment >> 32);
+  beat_increment_fraction = static_cast<uint32_t>(increment);
+  const ClockRatio& ratio = clock_ratios[params.clock_ratio_index];
+  step_samples = period_samples * static_cast<float>(1u << ratio.divide_shift) /
+                 static_cast<float>(ratio.multiply);
+  UpdateGroove();
+}
+
+// Function to get the step position (32.32 fixed point) of a beat position
+uint64_t StepPosition(uint32_t beats, uint32_t phase, int ratio_index) {
+  const ClockRatio& ratio = clock_ratios[ratio_index];
+  uint64_t beat_position = (static_cast<uint64_t>(beats) << 32) | phase;
+  return (beat_position * ratio.multiply) >> ratio.divide_shift;
+}
+
+// Function to get the phase reached a number of samples after a boundary
+// A negative sample count gives a phase that wraps on the boundary.
+uint32_t PhaseAfter(int32_t samples, uint32_t increment) {
+  return static_cast<uint32_t>(samples) * increment;
+}
+
+// Function to quantize a note to a scale starting on the root note
+int QuantizeToScale(int note, int root_note, const ScaleDef& scale) {
+  int pitch_class = (note - root_note) % 12;
+  if (pitch_class < 0) pitch_class += 12;
+  return note + scale.snap[pitch_class];
+}
+
+// Function to get the note for a chord index of a note set
+// Held notes are played as they are; past the last held note the pattern
+// carries on an octave up, like the chord table. Chord notes are transposed
+// before being quantized to the chord's scale, so transposing stays in key.
+int ChordNote(const NoteSet& notes, int chord_index) {
+  if (notes.count > 0) {
+    const int8_t* order = pattern_def.as_played ? notes.played : notes.sorted;
+    return order[chord_index % notes.count] +
+           12 * (chord_index / notes.count) + transpose;
+  }
+  const ChordDef* chord = current_chord;
+  int note_offset = chord->intervals[chord_index];
+  return QuantizeToScale(notes.root + note_offset + transpose, notes.root,
+                         scale_table[chord->scale]);
+}
+
+// Function to get the chord index of the harmony note for a chord index
+int HarmonyIndex(int chord_index) {
+  return chord_index + 1 < CHORD_TABLE_SIZE ? chord_index + 1 : chord_index;
+}
+
+// Function to get the octave of an octave pass
+int PassOctave(const OctaveRange& range, int pass) {
+  if (range.mode == OCTAVE_DOWN) return range.octaves - 1 - pass;
+  if (range.mode == OCTAVE_BOUNCE && pass >= range.octaves) {
+    return 2 * (range.octaves - 1) - pass;
+  }
+  return pass;
+}
+
+// Function to get the number of octave passes before the sequence repeats
+int OctavePasses(const OctaveRange& range) {
+  if (range.mode == OCTAVE_BOUNCE && range.octaves > 1) {
+    return 2 * range.octaves - 2;
+  }
+  return range.octaves;
+}
+
+// Function to get the calibrated CV of a note (already clamped to 0-5V)
+float NoteCv(int note) {
+  if (note < 0) note = 0;
+  if (note >= NOTE_COUNT) note = NOTE_COUNT - 1;
+  return note_cv_table[note];
+}
+
+// Function to get the number of notes a pattern runs over for a note set
+int PatternNotes(const NoteSet& notes) {
+  return notes.count > 0 ? notes.count : current_chord->size;
+}
+
+// Function to rebuild the pattern and step_cv for the active notes (called
+// from the control task)
+// The pattern length follows the notes, so the position is kept within the
+// new pattern and the octave pass carries on where it was.
+void BuildStepCv() {
+  int current_pass = pass_start / pattern_length;
+  pattern_def = pattern_table[current_pattern](PatternNotes(active_notes));
+  pattern_length = pattern_def.length;
+  if (arp_step >= pattern_length) arp_step = 0;
+
+  const PatternDef& def = pattern_def;
+  const OctaveRange& range = octave_ranges[octave_range_index];
+  int passes = OctavePasses(range);
+  int i = 0;
+  for (int pass = 0; pass < passes; pass++) {
+    int octave_offset = 12 * PassOctave(range, pass);
+    for (int step = 0; step < def.length; step++) {
+      int chord_index = def.steps[step];
+      step_cv[i] = NoteCv(ChordNote(active_notes, chord_index) + octave_offset);
+      harmony_cv[i++] = NoteCv(
+          ChordNote(active_notes, HarmonyIndex(chord_index)) + octave_offset);
+    }
+  }
+  sequence_length = i;
+  pass_start = current_pass * pattern_length;
+  if (pass_start >= sequence_length) pass_start = 0;
+}
+
+// Function to get the step_cv index of a step of the current pass
+int StepIndex(int pattern_step, Random& random) {
+  return pass_start + GetPatternPosition(pattern_def, pattern_step, random);
+}
+
+// Function to fill in the second track of a step event
+void SetTrack2(StepEvent* event, int index, uint32_t step) {
+  switch (track2_mode) {
+    case TRACK2_ACCENT:
+      event->gate2 = event->pattern_step == 0;
+      event->cv2 = step_cv[index];
+      break;
+    case TRACK2_HARMONY:
+      event->gate2 = true;
+      event->cv2 = harmony_cv[index];
+      break;
+    case TRACK2_DIVIDED:
+      event->gate2 = step % TRACK2_DIVISION == 0;
+      event->cv2 = step_cv[index];
+      break;
+    default:
+      event->gate2 = false;
+      event->cv2 = 0.0f;
+      break;
+  }
+}
+
+// Function to update the CV for step 0 of whichever sequence the scheduler
+// starts next, including any pending note change
+// Uses a copy of the pattern generator so the queued sequence is unaffected.
+void UpdateRestartCv() {
+  Random random = pattern_random;
+  const NoteSet& notes = note_change_pending ? pending_notes : active_notes;
+  PatternDef def = note_change_pending
+                       ? pattern_table[current_pattern](PatternNotes(notes))
+                       : pattern_def;
+  int position = GetPatternPosition(def, 0, random);
+  int octave_offset = 12 * PassOctave(octave_ranges[octave_range_index], 0);
+  int chord_index = def.steps[position];
+  StepEvent event;
+  event.pattern_step = 0;
+  SetTrack2(&event, 0, 0);
+  restart_cv = NoteCv(ChordNote(notes, chord_index) + octave_offset);
+  restart_ratchets = GetPatternRatchets(def, 0);
+  restart_gate2 = event.gate2;
+  restart_cv2 =
+      track2_mode == TRACK2_HARMONY
+          ? NoteCv(ChordNote(notes, HarmonyIndex(chord_index)) + octave_offset)
+          : restart_cv;
+}
+
+// Function to make the pending notes the active ones
+void ApplyNoteChange() {
+  active_notes = pending_notes;
+  note_change_pending = false;
+  BuildStepCv();
+}
+
+// Function to move to the next step of the sequence (wrap around based on
+// pattern length, then on to the next octave pass)
+void AdvanceStep() {
+  if (++arp_step >= pattern_length) {
+    arp_step = 0;
+    pass_start += pattern_length;
+    if (pass_start >= sequence_length) pass_start = 0;
+  }
+}
+
+// Function to apply pending_notes at the next step 0, or at once if the
+// pattern is already at step 0 or not playing
+void QueueNoteChange() {
+  if (arp_step != 0 && gate_triggered) {
+    note_change_pending = true;
+  } else {
+    ApplyNoteChange();
+  }
+}
+
+// Function to update the held-note pool from CV_5 and gate_in_2 (called
+// from the control task)
+// The note is taken from the conditioned pitch input on the gate's rising
+// edge and released on its falling edge unless latched.
+void UpdateNotePool() {
+  bool gate = hal::ReadGate(hal::GATE_IN_2);
+  bool changed = false;
+  if (gate && !note_gate_prev) {
+    // Below about -0.92V CV_5 is under MIDI note 0, and the gate is ignored
+    note_gate_note = pitch_input.Note();
+    note_gate_valid = note_gate_note >= 0 && note_gate_note < NOTE_COUNT;
+    if (note_gate_valid) {
+      if (note_latch && note_pool.Contains(note_gate_note)) {
+        note_pool.Remove(note_gate_note);
+      } else {
+        note_pool.Insert(note_gate_note);
+      }
+      changed = true;
+    }
+  } else if (!gate && note_gate_prev && !note_latch && note_gate_valid) {
+    note_pool.Remove(note_gate_note);
+    changed = true;
+  }
+  note_gate_prev = gate;
+
+  if (changed) {
+    note_pool.Fill(&pending_notes);
+    QueueNoteChange();
+  }
+}
+
+#if ARP_MIDI
+// Function to update the held-note pool from MIDI note on / off (called
+// from the control task)
+void UpdateMidiNotes() {
+  bool changed = false;
+  MidiNote note;
+  while (midi_notes.Pop(&note)) {
+    if (note.note >= NOTE_COUNT) continue;
+    if (note.on) {
+      if (note_latch && note_pool.Contains(note.note)) {
+        note_pool.Remove(note.note);
+      } else {
+        note_pool.Insert(note.note);
+      }
+      changed = true;
+    } else if (!note_latch) {
+      note_pool.Remove(note.note);
+      changed = true;
+    }
+  }
+
+  if (changed) {
+    note_pool.Fill(&pending_notes);
+    QueueNoteChange();
+  }
+}
+#endif
+
+// Function to take a tap tempo press at tap_sample (called from the control
+// task)
+// A pause longer than a beat at MIN_BPM starts a new run of taps.
+void TapTempo(uint32_t tap_sample) {
+  const TempoEstimator::State& state = tap_tempo.GetState();
+  uint32_t max_interval = static_cast<uint32_t>(60.0f * SAMPLE_RATE / MIN_BPM);
+  if (state.edges > 0 && tap_sample - tap_last_sample > max_interval) {
+    tap_tempo.Reset();
+  }
+  tap_last_sample = tap_sample;
+  if (!tap_tempo.Process(tap_sample)) return;
+
+  bpm = 60.0f * SAMPLE_RATE / tap_tempo.Period();
+  if (bpm < MIN_BPM) bpm = MIN_BPM;
+  if (bpm > MAX_BPM) bpm = MAX_BPM;
+  beat_period_samples = 60.0f * SAMPLE_RATE / bpm;
+  tap_beat_sample = tap_tempo.BeatSample();
+  tap_count++;
+}
+
+// Presets
+// Holding the button for PRESET_SAVE_HOLD_MS without shifting a knob enters
+// preset mode (LED on) for the rest of the press: turning K1 picks a slot to
+// recall on release, and releasing without turning it saves the knob
+// settings to the current preset. The platform stores the bank, with the
+// current slot, from its main loop. A recalled preset waits for the control
+// pass less than a step before the next bar line, replaces all the settings
+// in that pass, and the scheduler restarts the pattern on the downbeat, so
+// the change lands on the bar (stopped, it applies at once). Knobs then pick
+// up from the recalled values like shifted knobs do. With ARP_GATE_IN_2_MODE
+// set to GATE_IN_2_PRESET each rising edge on gate_in_2 recalls the next
+// preset; these recalls are not stored, so sequencing presets doesn't wear
+// the flash.
+const float PRESET_SAVE_HOLD_MS = 2000.0f;  // Button hold for preset mode
+const int PRESET_FLASH_PASSES = 250;        // LED on after a save (passes)
+const uint32_t BEATS_PER_BAR = 4;
+
+PresetBank preset_bank;                     // All presets (control task owned)
+Preset recalled_preset;                     // Preset waiting for the bar
+bool preset_recall_pending = false;         // recalled_preset not applied yet
+volatile bool preset_save_pending = false;  // preset_bank not yet stored
+uint32_t bar_number = 0;                    // Bars since the last restart
+bool preset_mode = false;                   // This press is in preset mode
+bool preset_slot_chosen = false;            // K1 picked a slot in preset mode
+int preset_slot = 0;                        // Slot picked with K1
+SmoothedControl slot_control;               // CV_1 in preset mode
+bool preset_in_prev = false;                // gate_in_2 state on last loop
+int preset_flash = 0;                       // Passes left to hold the LED on
+
+// Quantized changes
+// Pattern, octave range, chord and groove changes from the knobs can be held
+// for the next beat, bar or phrase (BARS_PER_PHRASE bars, counted from the
+// last restart like bars) instead of applying from the next step computed.
+// A held change waits in pending_changes with the beat it is due on, one
+// slot per setting, so turning the knob again replaces the value still
+// waiting and turning it back cancels it. Before computing each step the
+// producer applies whatever is due, and since steps are computed
+// STEP_LOOKAHEAD ahead, the step on the boundary is the first one with the
+// new setting; a new pattern starts from its first step there. The groove is
+// the scheduler's, so it goes over with the step it starts on. A change made
+// once the boundary step is queued waits for the boundary after, a restart
+// applies all held changes, and stopped, changes apply at once. Select the
+// boundary at build time with ARP_CHANGE_QUANTIZE; note changes wait for the
+// next pass through the pattern either way.
+enum ChangeQuantize {
+  CHANGE_AT_STEP = 0,  // Apply from the next step computed
+  CHANGE_AT_BEAT,      // Hold for the next beat
+  CHANGE_AT_BAR,       // Hold for the next bar line
+  CHANGE_AT_PHRASE,    // Hold for the next phrase
+};
+
+#ifndef ARP_CHANGE_QUANTIZE
+#define ARP_CHANGE_QUANTIZE CHANGE_AT_STEP
+#endif
+
+enum ChangeSetting {
+  CHANGE_PATTERN = 0,   // current_pattern
+  CHANGE_OCTAVE_RANGE,  // octave_range_index
+  CHANGE_CHORD,         // current_chord_index
+  CHANGE_GROOVE,        // groove_index
+  CHANGE_SETTING_COUNT,
+};
+
+struct PendingChange {
+  int value;          // Value to apply
+  uint32_t due_beat;  // Beat since the last restart it applies on
+};
+
+const ChangeQuantize change_quantize = ARP_CHANGE_QUANTIZE;  // Boundary
+const uint32_t BARS_PER_PHRASE = 4;
+
+PendingChange pending_changes[CHANGE_SETTING_COUNT];  // Held changes
+uint32_t pending_change_mask = 0;      // Bit per setting with a change held
+bool groove_change_held = false;       // groove_index waits for the step
+uint32_t groove_change_sequence = 0;   // Sequence of the step it starts on
+uint32_t groove_change_step = 0;       // Step within that sequence
+
+// Function to get the knob position in the middle of segment index of count
+float SegmentValue(int index, int count) {
+  return (index + 0.5f) / count;
+}
+
+// Function to capture the current settings into a preset
+void CapturePreset(Preset* preset) {
+  // The gate as a knob position that gives the same mode and length
+  float gate = gate_fraction;
+  if (gate_mode == GATE_MODE_TRIGGER) gate = 0.0f;
+  if (gate_mode == GATE_MODE_LEGATO) gate = 1.0f;
+  preset->pattern = current_pattern;
+  preset->octave_range = octave_range_index;
+  preset->bpm_x10 = static_cast<uint16_t>(bpm * 10.0f + 0.5f);
+  preset->groove = groove_index;
+  preset->clock_ratio = clock_ratio_index;
+  preset->rhythm = rhythm_index;
+  preset->rotation = rhythm_rotation;
+  preset->gate_length = static_cast<uint8_t>(gate * 255.0f + 0.5f);
+}
+
+// Function to check a stored preset only holds valid settings
+bool PresetValid(const Preset& preset) {
+  float preset_bpm = preset.bpm_x10 / 10.0f;
+  return preset.pattern < ARP_PATTERN_COUNT &&
+         preset.octave_range < OCTAVE_RANGE_COUNT && preset_bpm >= MIN_BPM &&
+         preset_bpm <= MAX_BPM && preset.groove < GROOVE_COUNT &&
+         preset.clock_ratio < CLOCK_RATIO_COUNT &&
+         preset.rhythm < RHYTHM_COUNT &&
+         preset.rotation < rhythms[preset.rhythm].steps;
+}
+
+// Function to replace the current settings with a preset (called from the
+// control task)
+// Every setting changes in the same pass, and each knob holds its recalled
+// value until it is turned back to it.
+void ApplyPreset(const Preset& preset) {
+  current_pattern = static_cast<ArpPattern>(preset.pattern);
+  pass_start = 0;
+  octave_range_index = preset.octave_range;
+  groove_index = preset.groove;
+  pending_change_mask = 0;
+  groove_change_held = false;
+  clock_ratio_index = preset.clock_ratio;
+  rhythm_index = preset.rhythm;
+  rhythm_rotation = preset.rotation;
+  UpdateRhythm();
+  float gate = preset.gate_length / 255.0f;
+  SetGateLength(gate);
+
+  // The tempo only applies to the internal clock; an external one keeps
+  // its own
+  float preset_bpm = preset.bpm_x10 / 10.0f;
+  if (internal_clock_enabled) {
+    bpm = preset_bpm;
+    beat_period_samples = 60.0f * SAMPLE_RATE / bpm;
+  }
+  BuildStepCv();
+  UpdateRestartCv();
+
+  pattern_control.SetValue(SegmentValue(current_pattern, ARP_PATTERN_COUNT));
+  octave_control.SetValue(
+      SegmentValue(octave_range_index, OCTAVE_RANGE_COUNT));
+  tempo_control.SetValue((preset_bpm - MIN_BPM) / (MAX_BPM - MIN_BPM));
+  groove_control.SetValue(SegmentValue(groove_index, GROOVE_COUNT));
+  rate_control.SetValue(SegmentValue(clock_ratio_index, CLOCK_RATIO_COUNT));
+  rhythm_control.SetValue(SegmentValue(rhythm_index, RHYTHM_COUNT));
+  rotation_control.SetValue(
+      SegmentValue(rhythm_rotation, rhythms[rhythm_index].steps));
+  gate_control.SetValue(gate);
+  pattern_control.Catch();
+  octave_control.Catch();
+  tempo_control.Catch();
+  groove_control.Catch();
+  rate_control.Catch();
+  rhythm_control.Catch();
+  rotation_control.Catch();
+  gate_control.Catch();
+}
+
+// Function to save the current settings to a preset slot (called from the
+// control task)
+void SavePreset(int slot) {
+  CapturePreset(&preset_bank.presets[slot]);
+  preset_bank.current = slot;
+  preset_save_pending = true;
+  preset_flash = PRESET_FLASH_PASSES;
+}
+
+// Function to recall a preset slot at the next bar line
+void RecallPreset(int slot) {
+  recalled_preset = preset_bank.presets[slot];
+  preset_bank.current = slot;
+  preset_recall_pending = true;
+}
+
+// Function to apply a recalled preset in the last control pass before the
+// next bar line, or at once while stopped (called from the control task)
+// Steps before the bar were computed and queued with the old settings; the
+// ones computed after belong to the old sequence, which the restart drops.
+void UpdatePresetRecall() {
+  if (!preset_recall_pending) return;
+  if (gate_triggered && transport_running && midi_running) {
+    // Beat count first: a beat wrap in between only overestimates
+    uint32_t beats = beat_count;
+    uint32_t phase = beat_phase;
+    uint64_t beats_left = BEATS_PER_BAR - beats % BEATS_PER_BAR;
+    uint64_t bar_phase = (beats_left << 32) - phase;
+    float samples_to_bar = static_cast<float>(bar_phase / beat_increment);
+    if (samples_to_bar >= step_samples) return;
+    bar_restart_requests++;
+  }
+  preset_recall_pending = false;
+  ApplyPreset(recalled_preset);
+}
+
+// Function to get the beats from one change boundary to the next
+uint32_t ChangeBeats() {
+  switch (change_quantize) {
+    case CHANGE_AT_BEAT:
+      return 1;
+    case CHANGE_AT_BAR:
+      return BEATS_PER_BAR;
+    default:
+      return BEATS_PER_BAR * BARS_PER_PHRASE;
+  }
+}
+
+// Function to get the first change boundary at or after the start of the
+// next step to compute, in beats since the last restart
+uint32_t NextChangeBeat() {
+  // In 1/multiply beats every step starts on a whole unit
+  const ClockRatio& ratio = clock_ratios[clock_ratio_index];
+  uint64_t position = static_cast<uint64_t>(producer_step + step_grid_offset)
+                      << ratio.divide_shift;
+  uint64_t spacing = static_cast<uint64_t>(ChangeBeats()) * ratio.multiply;
+  return static_cast<uint32_t>((position + spacing - 1) / spacing) *
+         ChangeBeats();
+}
+
+// Function to apply a change to a setting; held is set when it applies from
+// the next step computed rather than straight away
+void ApplyChange(int setting, int value, bool held) {
+  switch (setting) {
+    case CHANGE_PATTERN:
+      current_pattern = static_cast<ArpPattern>(value);
+      arp_step = 0;
+      pass_start = 0;
+      break;
+    case CHANGE_OCTAVE_RANGE:
+      octave_range_index = value;
+      break;
+    case CHANGE_CHORD:
+      current_chord_index = static_cast<ArpChord>(value);
+      current_chord = &chord_table[value];
+      break;
+    case CHANGE_GROOVE:
+      groove_index = value;
+      groove_change_held = held;
+      groove_change_sequence = producer_sequence;
+      groove_change_step = producer_step;
+      return;
+  }
+  BuildStepCv();
+  UpdateRestartCv();
+}
+
+// Function to get the value a setting is heading for: its held change, if
+// there is one, or current
+int ChangeTarget(int setting, int current) {
+  return pending_change_mask & (1u << setting) ? pending_changes[setting].value
+                                               : current;
+}
+
+// Function to change a setting from the next step computed, or hold the
+// change for the next boundary while playing (called from the control task)
+// A new pattern restarts the sequence on the next step when applied at once.
+void RequestChange(int setting, int value, int current) {
+  uint32_t bit = 1u << setting;
+  pending_change_mask &= ~bit;
+  if (value == current) return;
+  if (change_quantize != CHANGE_AT_STEP && gate_triggered &&
+      transport_running && midi_running) {
+    pending_changes[setting].value = value;
+    pending_changes[setting].due_beat = NextChangeBeat();
+    pending_change_mask |= bit;
+    return;
+  }
+  ApplyChange(setting, value, false);
+  if (setting == CHANGE_PATTERN) step_reset_requests++;
+}
+
+// Function to apply the held changes due on the next step to compute, or all
+// of them (called from the control task)
+void ApplyDueChanges(bool all) {
+  const ClockRatio& ratio = clock_ratios[clock_ratio_index];
+  uint64_t position = static_cast<uint64_t>(producer_step + step_grid_offset)
+                      << ratio.divide_shift;
+  for (int setting = 0; setting < CHANGE_SETTING_COUNT; setting++) {
+    uint32_t bit = 1u << setting;
+    if (!(pending_change_mask & bit)) continue;
+    const PendingChange& change = pending_changes[setting];
+    if (!all && position < static_cast<uint64_t>(change.due_beat) *
+                               ratio.multiply) {
+      continue;
+    }
+    pending_change_mask &= ~bit;
+    ApplyChange(setting, change.value, true);
+  }
+}
+
+// Function to publish the settings to the scheduler as a new snapshot
+// (called from the control task, once its pass is complete)
+void PublishParams() {
+  int back = 1 - params_front;
+  SchedulerParams& next = params_buffer[back];
+  next.beat_period = beat_period_samples;
+  next.clock_ratio_index = clock_ratio_index;
+  next.groove_index = groove_index;
+  next.groove_held = groove_change_held;
+  next.groove_sequence = groove_change_sequence;
+  next.groove_step = groove_change_step;
+  next.gate_mode = gate_mode;
+  next.gate_fraction = gate_fraction;
+  next.rhythm_mask = rhythm_mask;
+  next.rhythm_length = rhythm_length;
+  next.step_threshold = step_threshold;
+  next.restart_cv = restart_cv;
+  next.restart_ratchets = restart_ratchets;
+  next.restart_cv2 = restart_cv2;
+  next.restart_gate2 = restart_gate2;
+  next.restarts = restart_requests;
+  next.step_resets = step_reset_requests;
+  next.bar_restarts = bar_restart_requests;
+  next.taps = tap_count;
+  next.tap_beat_sample = tap_beat_sample;
+  std::atomic_signal_fence(std::memory_order_release);
+  params_front = back;
+}
+
+// Function to keep the step event queue filled STEP_LOOKAHEAD steps ahead of
+// the scheduler (called from the control task)
+void FillStepEvents() {
+  uint32_t sequence = sequence_id;
+  if (sequence != producer_sequence) {
+    // The scheduler restarted the pattern and played step 0 from restart_cv,
+    // which already included any pending note change
+    producer_sequence = sequence;
+    producer_step = 1;
+    arp_step = 0;
+    pass_start = 0;
+    if (pending_change_mask) ApplyDueChanges(true);
+    if (note_change_pending) ApplyNoteChange();
+
+    // Draw step 0 the way restart_cv did, so a locked pattern reseeds and
+    // the rest of the cycle follows its order
+    StepIndex(0, pattern_random);
+    AdvanceStep();
+  }
+
+  while (static_cast<int32_t>(producer_step - sequence_step) <
+         static_cast<int32_t>(STEP_LOOKAHEAD)) {
+    // Held changes due on this step apply before it is computed, and a
+    // pending note change at step 0
+    if (pending_change_mask) ApplyDueChanges(false);
+    if (arp_step == 0 && note_change_pending) ApplyNoteChange();
+
+    StepEvent event;
+    event.sequence = sequence;
+    event.step = producer_step;
+    event.pattern_step = arp_step;
+    int index = StepIndex(arp_step, pattern_random);
+    event.cv = step_cv[index];
+    event.gate = true;
+    event.ratchets = GetPatternRatchets(pattern_def, arp_step);
+    SetTrack2(&event, index, producer_step);
+    if (!step_events.Push(event)) break;
+
+    producer_step++;
+    AdvanceStep();
+  }
+
+  UpdateRestartCv();
+}
+
+// Function to raise gate_out_1 for one hit of the current step and schedule
+// its gate-off
+// Gates are cut short to leave GATE_MIN_GAP_SAMPLES before the next hit,
+// which a groove can move closer. A legato step has no gate-off; a
+// ratcheted one still retriggers.
+void RaiseGate() {
+  float hit_samples = step_interval / step_ratchets;
+  float max_samples = hit_samples - GATE_MIN_GAP_SAMPLES;
+  float samples;
+  gate_held = false;
+  if (params.gate_mode == GATE_MODE_TRIGGER) {
+    samples = GATE_PULSE_SAMPLES;
+  } else if (params.gate_mode == GATE_MODE_LENGTH) {
+    samples = hit_samples * params.gate_fraction;
+  } else {
+    samples = max_samples;
+    gate_held = step_ratchets == 1;
+  }
+  if (samples > max_samples) samples = max_samples;
+  if (samples < GATE_MIN_SAMPLES) samples = GATE_MIN_SAMPLES;
+
+  hal::WriteGate(hal::GATE_OUT_1, true);
+  gate_out_high = true;
+  gate_off_sample = sample_clock + static_cast<uint32_t>(samples);
+}
+
+// Function to raise gate_out_2 for a step; it follows the length of the
+// first gate_out_1 hit of the step
+void RaiseGate2() {
+  hal::WriteGate(hal::GATE_OUT_2, true);
+  gate2_out_high = true;
+  gate2_off_sample = gate_off_sample;
+  gate2_held = gate_held;
+}
+
+// Function to check the next step against the rhythm mask and probability
+// (called once per step from the scheduler)
+bool RhythmHit() {
+  int step = rhythm_step;
+  rhythm_step = step + 1 >= params.rhythm_length ? 0 : step + 1;
+  if (!((params.rhythm_mask >> step) & 1)) return false;
+  return rhythm_random.Next() <= params.step_threshold;
+}
+
+// Function to write a step to both tracks, unless the rhythm missed it
+// A step without a gate leaves the track's CV on the last note.
+void WriteStep(const StepEvent& event, bool hit) {
+  bool gate = event.gate && hit;
+  bool gate2 = event.gate2 && hit;
+  if (gate) {
+    // gate_held is still the previous step's: a tied step glides
+    bool glide = glide_mode == GLIDE_ALWAYS ||
+                 (glide_mode == GLIDE_LEGATO && gate_held && gate_out_high);
+    uint32_t blocks =
+        glide ? static_cast<uint32_t>(step_interval * GLIDE_FRACTION) /
+                    AUDIO_BLOCK_SIZE
+              : 0;
+    cv_slew.Start(event.cv, blocks);
+    if (blocks == 0) hal::WriteCv(hal::CV_OUT_1, event.cv);
+  }
+  if (gate2) hal::WriteCv(hal::CV_OUT_2, event.cv2);
+  step_gate = gate;
+  step_ratchets = event.ratchets;
+  ratchet_hit = 0;
+  ratchet_next_sample =
+      sample_clock + static_cast<uint32_t>(step_interval / event.ratchets);
+  if (gate) {
+    RaiseGate();
+  } else {
+    gate_held = false;
+  }
+  if (gate2) {
+    RaiseGate2();
+  } else {
+    gate2_held = false;
+  }
+}
+
+// Function to play the next arpeggio step (called from the scheduler)
+// With restart set, a new sequence is started from step 0.
+void PlayStep(bool restart) {
+  if (restart) {
+    // Drop events computed for the old sequence
+    StepEvent stale;
+    while (step_events.Pop(&stale)) {
+    }
+    sequence_id = sequence_id + 1;
+    sequence_step = 1;
+    step_grid_offset = step_number;
+    rhythm_step = 0;
+    StepEvent event;
+    event.cv = params.restart_cv;
+    event.gate = true;
+    event.ratchets = params.restart_ratchets;
+    event.cv2 = params.restart_cv2;
+    event.gate2 = params.restart_gate2;
+    WriteStep(event, RhythmHit());
+    return;
+  }
+
+  // Find this step's event, dropping any left over from an old sequence
+  StepEvent event;
+  uint32_t step = sequence_step;
+  sequence_step = step + 1;
+  step_grid_offset = step_number - step;
+  while (step_events.Peek(&event)) {
+    if (event.sequence == sequence_id &&
+        static_cast<int32_t>(event.step - step) >= 0) {
+      break;
+    }
+    step_events.Pop(&event);
+  }
+  if (!step_events.Peek(&event) || event.step != step) {
+    // The control task fell more than STEP_LOOKAHEAD steps behind; skip
+    // this step
+    profile.step_underruns++;
+    RhythmHit();
+    step_gate = false;
+    gate_held = false;
+    gate2_held = false;
+    return;
+  }
+  step_events.Pop(&event);
+  WriteStep(event, RhythmHit());
+}
+
+// Function to timestamp clock edges from the selected external clock source
+// (called once per block)
+void CaptureClockInput(uint32_t block_start, const float* audio_in,
+                       size_t size) {
+  bool clock_in = hal::ReadGate(hal::GATE_IN_1);
+  if (external_clock_source == CLOCK_SOURCE_GATE) {
+    if (clock_in && !clock_in_prev) {
+      if (!clock_edges.Push(block_start)) profile.clock_edges_dropped++;
+    }
+  } else if (external_clock_source == CLOCK_SOURCE_AUDIO) {
+    size_t offset = 0;
+    if (audio_clock.Process(audio_in, size, &offset)) {
+      if (!clock_edges.Push(block_start + offset)) {
+        profile.clock_edges_dropped++;
+      }
+    }
+  }
+  clock_in_prev = clock_in;
+
+  if (gate_in_2_mode == GATE_IN_2_RESET || gate_in_2_mode == GATE_IN_2_RUN) {
+    bool reset_in = hal::ReadGate(hal::GATE_IN_2);
+    reset_edge = reset_in && !reset_in_prev;
+    if (gate_in_2_mode == GATE_IN_2_RUN) transport_running = reset_in;
+    reset_in_prev = reset_in;
+  }
+}
+
+#if ARP_MIDI
+// Function to take the MIDI received since the last block (called once per
+// block, after CaptureClockInput)
+void CaptureMidiInput(uint32_t block_start) {
+  // Only the MIDI clock source can be stopped; MIDI transport is ignored in
+  // internal clock mode and for the other external sources
+  bool midi_clocked =
+      !internal_clock_enabled && external_clock_source == CLOCK_SOURCE_MIDI;
+  if (!midi_clocked) {
+    midi_running = true;
+    midi_start_pending = false;
+  }
+
+  hal::MidiMessage message;
+  while (hal::ReadMidi(&message)) {
+    switch (message.status) {
+      case hal::MIDI_CLOCK:
+        if (!midi_clocked) break;
+        if (midi_start_pending) {
+          // Reset on this block; the estimator expects the tick's edge here
+          midi_start_pending = false;
+          midi_running = true;
+          midi_ticks = 0;
+          reset_edge = true;
+        }
+        if (midi_ticks == 0 && !clock_edges.Push(block_start)) {
+          profile.clock_edges_dropped++;
+        }
+        midi_ticks = midi_ticks + 1 >= MIDI_PPQN ? 0 : midi_ticks + 1;
+        break;
+      case hal::MIDI_START:
+        if (midi_clocked) midi_start_pending = true;
+        break;
+      case hal::MIDI_CONTINUE:
+        midi_running = true;
+        break;
+      case hal::MIDI_STOP:
+        if (midi_clocked) midi_running = false;
+        break;
+      case hal::MIDI_NOTE_ON:
+      case hal::MIDI_NOTE_OFF: {
+        MidiNote note;
+        note.note = message.note;
+        note.on = message.status == hal::MIDI_NOTE_ON && message.velocity > 0;
+        if (!midi_notes.Push(note)) profile.midi_notes_dropped++;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
+#endif
+
+// Function to move the beat position onto a beat at beat_sample
+// Snaps to whichever beat the current position is closest to, plus the
+// whole beats since beat_sample; samples since that beat are negative if it
+// is still ahead.
+void SnapBeat(uint32_t block_start, uint32_t beat_sample) {
+  int32_t elapsed = static_cast<int32_t>(block_start - beat_sample);
+  uint32_t beat = beat_phase < 0x80000000u ? beat_count : beat_count + 1;
+  uint64_t position = (static_cast<uint64_t>(beat) << 32) +
+                      static_cast<uint64_t>(static_cast<int64_t>(elapsed) *
+                                            beat_increment);
+  beat_count = static_cast<uint32_t>(position >> 32);
+  beat_phase = static_cast<uint32_t>(position);
+}
+
+// Function to move the beat position onto a beat at beat_sample that has
+// already passed, without playing it
+// The step the new position is in counts as played, so the grid takes over
+// from its next step instead of a passed step playing late.
+void SnapPastBeat(uint32_t block_start, uint32_t beat_sample) {
+  SnapBeat(block_start, beat_sample);
+  step_number = static_cast<uint32_t>(
+      StepPosition(beat_count, beat_phase, params.clock_ratio_index) >> 32);
+}
+
+// Function to restart the pattern on a downbeat at the start of the block
+// A gate still high is dropped and step 0 waits GATE_MIN_GAP_SAMPLES, so
+// the downbeat is always a new rising edge.
+void RestartSequence() {
+  bool gate_high = gate_out_high || gate2_out_high;
+  if (gate_out_high) {
+    hal::WriteGate(hal::GATE_OUT_1, false);
+    gate_out_high = false;
+  }
+  if (gate2_out_high) {
+    hal::WriteGate(hal::GATE_OUT_2, false);
+    gate2_out_high = false;
+  }
+  gate_held = false;
+  gate2_held = false;
+  gate_triggered = true;
+  sequence_restart = true;
+  step_due = !gate_high;
+  step_scheduled = gate_high;
+  step_fire_sample = sample_clock + GATE_MIN_GAP_SAMPLES;
+  step_ideal_sample = sample_clock - AUDIO_BLOCK_SIZE;
+  beat_count = 0;
+  beat_phase = 0;
+  bar_number = 0;
+  bar_restart_armed = false;
+  step_number = 0;
+}
+
+// Function to drain captured clock edges into the step scheduler
+// Edges go through the tempo estimator, and the beat position is realigned
+// to its filtered beat rather than to the raw edge, so one late pulse no
+// longer moves the whole beat. Steps between beats follow the clock ratio.
+void ProcessClockEdges(uint32_t block_start) {
+  if (clock_resync_pending) {
+    clock_resync_pending = false;
+    tempo.Reset();
+  }
+
+  uint32_t edge_sample;
+  while (clock_edges.Pop(&edge_sample)) {
+    // Edges are only used in external clock mode
+    if (internal_clock_enabled) continue;
+
+#if ARP_PROFILE
+    float period = tempo.Period();
+    uint32_t relocks = tempo.GetState().relocks;
+    uint32_t outliers = tempo.GetState().outliers;
+#endif
+    bool accepted = tempo.Process(edge_sample);
+#if ARP_PROFILE
+    bool tracked = accepted && tempo.GetState().relocks == relocks;
+    if (tracked && profile_edge_tracked) {
+      int32_t interval = static_cast<int32_t>(edge_sample - profile_last_edge);
+      int32_t jitter = interval - static_cast<int32_t>(period);
+      profile.clock_jitter.Add(jitter >= 0 ? jitter : -jitter);
+    }
+    if (tempo.GetState().outliers > outliers) profile.clock_outliers++;
+    profile_edge_tracked = tracked;
+    profile_last_edge = edge_sample;
+#endif
+
+    if (!accepted) {
+      // The first edge (or the first after a pause) starts the arpeggio;
+      // rejected edges and bursts are ignored and the scheduler keeps
+      // running on the predicted beat
+      if (tempo.GetState().edges == 1 && tempo.BeatSample() == edge_sample) {
+        int32_t elapsed = static_cast<int32_t>(block_start - edge_sample);
+        if (elapsed < 0) elapsed = 0;
+        gate_triggered = true;
+        sequence_restart = true;
+        step_due = true;
+        step_scheduled = false;
+        beat_count = 0;
+        beat_phase = PhaseAfter(elapsed, beat_increment);
+        step_number = 0;
+        step_ideal_sample = edge_sample;
+      }
+      continue;
+    }
+
+    // 1 gate = 1 quarter note; the clock ratio sets the steps per beat
+    clock_period_samples = tempo.Period();
+    SetBeatPeriod(clock_period_samples);
+
+    gate_triggered = true;
+    SnapBeat(block_start, tempo.BeatSample());
+  }
+}
+
+// Function to advance the step scheduler by one audio block
+// Steps fire on the block in which the step position passes a whole step, so
+// timing is accurate to one block (83us at 48kHz / 4 samples) instead of the
+// ~1ms resolution of the control task. A groove delays the step by its offset
+// from the grid, and ratchets split the step into evenly spaced gate hits
+// from wherever it was played.
+void ProcessScheduler(size_t size) {
+  uint32_t block_start = sample_clock;
+  sample_clock = block_start + size;
+
+  // Latest settings from the control task; a new tempo (internal clock),
+  // clock ratio or groove is turned into step timing here, except a held
+  // groove, which waits for its step
+  SchedulerParams prev_params = params;
+  int front = params_front;
+  std::atomic_signal_fence(std::memory_order_acquire);
+  params = params_buffer[front];
+  bool tempo_changed =
+      internal_clock_enabled && params.beat_period != clock_period_samples;
+  if (tempo_changed) clock_period_samples = params.beat_period;
+  bool groove_changed =
+      params.groove_index != active_groove && !params.groove_held;
+  if (groove_changed) active_groove = params.groove_index;
+  if (tempo_changed ||
+      params.clock_ratio_index != prev_params.clock_ratio_index ||
+      groove_changed) {
+    SetBeatPeriod(clock_period_samples);
+  }
+  if (params.bar_restarts != prev_params.bar_restarts) {
+    bar_restart_armed = true;
+  }
+
+  // Restart requested by the control task (internal clock start)
+  if (params.restarts != prev_params.restarts) RestartSequence();
+
+  // Reset on gate_in_2: the downbeat is the start of this block, and the
+  // external clock expects its next edge there
+  if (reset_edge) {
+    reset_edge = false;
+    if (!internal_clock_enabled) tempo.Realign(block_start);
+#if ARP_PROFILE
+    profile_edge_tracked = false;
+#endif
+    RestartSequence();
+  }
+
+  // External clock edges captured at the top of this block
+  ProcessClockEdges(block_start);
+
+  // Tapped beat from the control task, internal clock only; the tap is
+  // taken on release, so the grid takes over from the next step
+  if (params.taps != prev_params.taps && internal_clock_enabled) {
+    SnapPastBeat(block_start, params.tap_beat_sample);
+  }
+
+  // Pattern changed: start over from step 0 without moving the step grid
+  if (params.step_resets != prev_params.step_resets) sequence_restart = true;
+
+  // Advance the beat position; a beat phase wrap is a beat boundary
+  uint32_t prev_beat_phase = beat_phase;
+  uint64_t phase_fraction =
+      beat_phase_fraction +
+      static_cast<uint64_t>(beat_increment_fraction) * size;
+  beat_phase_fraction = static_cast<uint32_t>(phase_fraction);
+  beat_phase = prev_beat_phase + beat_increment * size +
+               static_cast<uint32_t>(phase_fraction >> 32);
+  if (beat_phase < prev_beat_phase) beat_count = beat_count + 1;
+
+  // A recalled preset starts the pattern over on the bar line (bars count
+  // from the last restart)
+  uint32_t bar = beat_count / BEATS_PER_BAR;
+  if (bar != bar_number) {
+    bar_number = bar;
+    if (bar_restart_armed) {
+      bar_restart_armed = false;
+      sequence_restart = true;
+    }
+  }
+
+  // A new ratio renumbers the steps; carry on from the current step rather
+  // than replaying or waiting for the old step number
+  int ratio_index = params.clock_ratio_index;
+  uint64_t step_position = StepPosition(beat_count, beat_phase, ratio_index);
+  uint32_t step = static_cast<uint32_t>(step_position >> 32);
+  if (ratio_index != active_ratio) {
+    active_ratio = ratio_index;
+    step_number = step;
+  }
+  if (static_cast<int32_t>(step - step_number) > 0) {
+    // A held groove starts on the step it was computed for, or at once if
+    // that sequence is over
+    if (params.groove_index != active_groove &&
+        (params.groove_sequence != sequence_id ||
+         static_cast<int32_t>(sequence_step - params.groove_step) >= 0)) {
+      active_groove = params.groove_index;
+      SetBeatPeriod(clock_period_samples);
+    }
+
+    // A step still waiting on its groove offset plays now
+    if (step_scheduled) step_due = true;
+    step_number = step;
+    step_scheduled = true;
+    step_fire_sample = sample_clock + groove_offsets[step & groove_mask];
+#if ARP_PROFILE
+    // The step position passed the step this many samples before the end
+    // of the block
+    const ClockRatio& ratio = clock_ratios[ratio_index];
+    uint64_t step_increment =
+        (static_cast<uint64_t>(beat_increment) * ratio.multiply) >>
+        ratio.divide_shift;
+    uint64_t fraction = step_position & 0xffffffffu;
+    uint32_t past =
+        step_increment ? static_cast<uint32_t>(fraction / step_increment) : 0;
+    step_ideal_sample = step_fire_sample - past;
+#endif
+  }
+  if (step_scheduled &&
+      static_cast<int32_t>(sample_clock - step_fire_sample) >= 0) {
+    step_scheduled = false;
+    step_due = true;
+  }
+
+  if (!gate_triggered || !transport_running || !midi_running) {
+    // If not triggered or stopped by the run gate or MIDI, make sure the
+    // gates are off
+    step_due = false;
+    step_scheduled = false;
+    gate_held = false;
+    gate2_held = false;
+    if (gate_out_high) {
+      hal::WriteGate(hal::GATE_OUT_1, false);
+      gate_out_high = false;
+    }
+    if (gate2_out_high) {
+      hal::WriteGate(hal::GATE_OUT_2, false);
+      gate2_out_high = false;
+    }
+    // A glide under way still ends on its note
+    if (cv_slew.Process()) hal::WriteCv(hal::CV_OUT_1, cv_slew.Value());
+    return;
+  }
+
+  // Gate-off is due; handled before any new hit so a gate ending on this
+  // block still falls
+  if (gate_out_high && !gate_held &&
+      static_cast<int32_t>(sample_clock - gate_off_sample) >= 0) {
+    hal::WriteGate(hal::GATE_OUT_1, false);
+    gate_out_high = false;
+  }
+  if (gate2_out_high && !gate2_held &&
+      static_cast<int32_t>(sample_clock - gate2_off_sample) >= 0) {
+    hal::WriteGate(hal::GATE_OUT_2, false);
+    gate2_out_high = false;
+  }
+
+  if (step_due) {
+    step_due = false;
+    step_interval = groove_intervals[step_number & groove_mask];
+#if ARP_PROFILE
+    int32_t lateness = static_cast<int32_t>(sample_clock - step_ideal_sample);
+    profile.step_lateness.Add(lateness > 0 ? lateness : 0);
+#endif
+    PlayStep(sequence_restart);
+    sequence_restart = false;
+  } else if (step_gate && ratchet_hit + 1 < step_ratchets &&
+             static_cast<int32_t>(sample_clock - ratchet_next_sample) >= 0) {
+    ratchet_hit++;
+    ratchet_next_sample += static_cast<uint32_t>(step_interval / step_ratchets);
+    RaiseGate();
+  }
+
+  // Glide CV_OUT_1 on towards the step's note
+  if (cv_slew.Process()) hal::WriteCv(hal::CV_OUT_1, cv_slew.Value());
+}
+
+// Function to clear the measurements
+void ResetProfile() {
+  profile.control.Init();
+  profile.callback.Init();
+  profile.step_lateness.Init();
+  profile.clock_jitter.Init();
+  profile.step_underruns = 0;
+  profile.clock_edges_dropped = 0;
+  profile.midi_notes_dropped = 0;
+  profile.clock_outliers = 0;
+}
+
+// Function to set up the engine with the CV output calibration (called once
+// at boot, before audio starts)
+void ArpInit(const CvCalibration& calibration, const PresetBank* presets) {
+  BuildNoteCvTable(calibration);
+  BuildStepCv();
+
+  // Free-running random patterns start from the hardware RNG
+  pattern_random.Seed(hal::RandomValue());
+  rhythm_random.Seed(hal::RandomValue());
+
+  // Control smoothing and pitch input conditioning
+  pattern_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  tempo_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  rate_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  gate_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  groove_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  groove_control.SetValue(0.5f / GROOVE_COUNT);  // Middle of the first groove
+  octave_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  octave_control.SetValue(0.5f / OCTAVE_RANGE_COUNT);
+  transpose_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  rhythm_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  rhythm_control.SetValue(0.5f / RHYTHM_COUNT);
+  rotation_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  rotation_control.SetValue(0.0f);
+  probability_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  slot_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  chord_control.Init(CONTROL_SMOOTHING, CONTROL_HYSTERESIS);
+  pitch_input.Init();
+  cv_slew.Reset(0.0f);
+  cv_filter.Init(CV_FILTER_CUTOFF_HZ * AUDIO_BLOCK_SIZE / SAMPLE_RATE);
+  note_pool.Init();
+
+  // External clock tempo tracking
+  audio_clock.Init(SAMPLE_RATE);
+  tempo.Init(TEMPO_LOCK_TIME_BEATS);
+  tap_tempo.Init(TAP_LOCK_TIME_BEATS);
+
+  // Empty or invalid slots hold the power-up settings; the current preset
+  // is recalled straight away
+  Preset defaults;
+  CapturePreset(&defaults);
+  preset_bank.version = PRESET_VERSION;
+  preset_bank.current = 0;
+  bool stored = presets && presets->version == PRESET_VERSION &&
+                presets->current < PRESET_COUNT;
+  for (int slot = 0; slot < PRESET_COUNT; slot++) {
+    bool valid = stored && PresetValid(presets->presets[slot]);
+    preset_bank.presets[slot] = valid ? presets->presets[slot] : defaults;
+  }
+  if (stored) {
+    RecallPreset(presets->current);
+    UpdatePresetRecall();
+  }
+
+  // The scheduler starts from the same settings
+  UpdateRestartCv();
+  PublishParams();
+  params = params_buffer[params_front];
+  active_groove = params.groove_index;
+  clock_period_samples = beat_period_samples;
+  SetBeatPeriod(clock_period_samples);
+
+#if ARP_PROFILE
+  ResetProfile();
+#endif
+}
+
+// Function to capture the clock and advance the step scheduler by one audio
+// block (called from the audio callback, before any audio is processed, so
+// outputs change at the start of the block)
+void ArpProcessBlock(const float* audio_in, size_t size) {
+#if ARP_CV_FILTER
+  float samples[CV_INPUTS];
+  for (int input = 0; input < CV_INPUTS; input++) {
+    samples[input] = hal::SampleCv(static_cast<hal::CvInput>(input));
+  }
+  cv_filter.Process(samples);
+#endif
+  CaptureClockInput(sample_clock, audio_in, size);
+#if ARP_MIDI
+  CaptureMidiInput(sample_clock);
+#endif
+  ProcessScheduler(size);
+}
+
+// Function to read the controls and compute the next steps (called from the
+// control task, CONTROL_RATE_HZ)
+void ArpProcessControls() {
+  const hal::ButtonState button = hal::ReadButton();
+#if ARP_CV_FILTER
+  cv_filter.Read(cv_readings);
+#else
+  for (int input = 0; input < CV_INPUTS; input++) {
+    cv_readings[input] = hal::ReadCv(static_cast<hal::CvInput>(input));
+  }
+#endif
+
+  // Read the toggle switch state directly (on = internal clock, off =
+  // external)
+  bool prev_internal_clock_enabled = internal_clock_enabled;
+  internal_clock_enabled = hal::ReadToggle();
+
+  // Holding the button shifts K1 from pattern to octave range, K2 from
+  // tempo to groove, K3 from clock rate to rhythm and K4 from gate length
+  // to rhythm rotation; each picks up
+  // where it was left instead of jumping to the knob position
+  bool shift = button.pressed;
+  if (button.rising_edge) {
+    tap_press_sample = sample_clock;
+    groove_control.Catch();
+    octave_control.Catch();
+    rhythm_control.Catch();
+    rotation_control.Catch();
+    shift_used = false;
+  }
+  if (button.falling_edge) {
+    tempo_control.Catch();
+    pattern_control.Catch();
+    rate_control.Catch();
+    gate_control.Catch();
+  }
+
+  // Read CV_2 for tempo control
+  // Pots on Patch.init() return 0 to 1 range
+  bool tempo_changed =
+      !shift && tempo_control.Process(cv_readings[hal::CV_2]);
+
+  // Read CV_2 for the groove while shifted
+  if (shift && groove_control.Process(cv_readings[hal::CV_2])) {
+    shift_used = true;
+    int target = ChangeTarget(CHANGE_GROOVE, groove_index);
+    int new_groove = SelectGroove(groove_control.Value(), target);
+    if (new_groove != target) {
+      RequestChange(CHANGE_GROOVE, new_groove, groove_index);
+    }
+  }
+
+  // Update tempo from pot when internal clock is enabled
+  // Internal clock mode: BPM sets the beat, and the scheduler increment
+  // only changes with the tempo
+  if (internal_clock_enabled &&
+      (tempo_changed || !prev_internal_clock_enabled)) {
+    float tempo_cv = tempo_control.Value();
+    // Handle pot (0 to 1) or bipolar CV (-1 to +1)
+    float tempo_cv_normalized;
+    if (tempo_cv < 0.0f) {
+      // Bipolar CV input: convert -1..+1 to 0..1
+      tempo_cv_normalized = (tempo_cv + 1.0f) / 2.0f;
+    } else {
+      // Pot: already 0..1
+      tempo_cv_normalized = tempo_cv;
+    }
+    // Clamp to 0-1 range
+    if (tempo_cv_normalized < 0.0f) tempo_cv_normalized = 0.0f;
+    if (tempo_cv_normalized > 1.0f) tempo_cv_normalized = 1.0f;
+
+    bpm = MIN_BPM + tempo_cv_normalized * (MAX_BPM - MIN_BPM);
+    beat_period_samples = 60.0f * SAMPLE_RATE / bpm;
+  }
+
+  // If we just disabled internal clock, reset the gate trigger state
+  if (!internal_clock_enabled && prev_internal_clock_enabled) {
+    gate_triggered = false;
+    clock_resync_pending = true;
+  }
+
+  // Releasing the button without shifting a knob either toggles the note
+  // latch (after a long press; unlatching drops the held notes) or, after
+  // a short press, taps the tempo with the internal clock, or steps the
+  // external clock on from gate_in_1 to audio input to MIDI clock, and the
+  // tempo estimator starts over on the new source. Holding it even longer
+  // enters preset mode instead, which saves or recalls a preset.
+  if (button.pressed && button.held_ms >= LATCH_HOLD_MS) {
+    button_long_press = true;
+  }
+  if (button.pressed && button.held_ms >= PRESET_SAVE_HOLD_MS &&
+      !shift_used && !preset_mode) {
+    preset_mode = true;
+    preset_slot_chosen = false;
+    preset_slot = preset_bank.current;
+    slot_control.SetValue(SegmentValue(preset_slot, PRESET_COUNT));
+    slot_control.Catch();
+  }
+  if (button.falling_edge) {
+    if (preset_mode) {
+      // The press saves or recalls a preset and does nothing else; a
+      // recall from the panel is stored as the current slot
+      if (preset_slot_chosen) {
+        RecallPreset(preset_slot);
+        preset_save_pending = true;
+      } else if (!shift_used) {
+        SavePreset(preset_bank.current);
+      }
+    } else if (!shift_used && button_long_press) {
+      note_latch = !note_latch;
+      if (!note_latch) {
+        note_pool.Clear();
+        note_pool.Fill(&pending_notes);
+        QueueNoteChange();
+      }
+    } else if (!shift_used && internal_clock_enabled) {
+      TapTempo(tap_press_sample);
+    } else if (!shift_used && !internal_clock_enabled) {
+      int source = external_clock_source + 1;
+      if (source > (ARP_MIDI ? CLOCK_SOURCE_MIDI : CLOCK_SOURCE_AUDIO)) {
+        source = CLOCK_SOURCE_GATE;
+      }
+      external_clock_source = static_cast<ClockSource>(source);
+      clock_resync_pending = true;
+    }
+    button_long_press = false;
+    preset_mode = false;
+  }
+
+  // Read K3 and K4 for the rhythm and its rotation while shifted
+  if (shift && rhythm_control.Process(cv_readings[hal::CV_3])) {
+    shift_used = true;
+    int new_rhythm = SelectRhythm(rhythm_control.Value(), rhythm_index);
+    if (new_rhythm != rhythm_index) {
+      rhythm_index = new_rhythm;
+      UpdateRhythm();
+    }
+  }
+  if (shift && rotation_control.Process(cv_readings[hal::CV_4])) {
+    shift_used = true;
+    int new_rotation =
+        SelectRotation(rotation_control.Value(), rhythm_rotation);
+    if (new_rotation != rhythm_rotation) {
+      rhythm_rotation = new_rotation;
+      UpdateRhythm();
+    }
+  }
+
+  // Read CV input 6 for step probability
+  if (probability_control.Process(cv_readings[hal::CV_6])) {
+    SetStepProbability(probability_control.Value());
+  }
+
+  // Read CV_3 for the clock rate (steps per beat, both clock modes)
+  if (!shift && rate_control.Process(cv_readings[hal::CV_3])) {
+    int new_ratio = SelectClockRatio(rate_control.Value(), clock_ratio_index);
+    if (new_ratio != clock_ratio_index) {
+      clock_ratio_index = new_ratio;
+    }
+  }
+
+  // Read CV_4 for the gate length
+  if (!shift && gate_control.Process(cv_readings[hal::CV_4])) {
+    SetGateLength(gate_control.Value());
+  }
+
+  // Read CV input 1 for pattern selection (bipolar -5V to +5V)
+  if (!shift && pattern_control.Process(cv_readings[hal::CV_1])) {
+    ArpPattern target = static_cast<ArpPattern>(
+        ChangeTarget(CHANGE_PATTERN, current_pattern));
+    ArpPattern new_pattern = SelectPattern(pattern_control.Value(), target);
+
+    // Update pattern if it changed
+    if (new_pattern != target) {
+      RequestChange(CHANGE_PATTERN, new_pattern, current_pattern);
+    }
+  }
+
+  // Read K1 for the preset slot in preset mode, or else the octave range
+  // while shifted
+  if (preset_mode) {
+    if (slot_control.Process(cv_readings[hal::CV_1])) {
+      int slot =
+          SelectSegment(slot_control.Value(), preset_slot, PRESET_COUNT);
+      if (slot != preset_slot) {
+        preset_slot = slot;
+        preset_slot_chosen = true;
+      }
+    }
+  } else if (shift && octave_control.Process(cv_readings[hal::CV_1])) {
+    shift_used = true;
+    int target = ChangeTarget(CHANGE_OCTAVE_RANGE, octave_range_index);
+    int new_range = SelectOctaveRange(octave_control.Value(), target);
+    if (new_range != target) {
+      RequestChange(CHANGE_OCTAVE_RANGE, new_range, octave_range_index);
+    }
+  }
+
+  // Read CV input 7 for transposition (1V/octave, bipolar), rounded to a
+  // semitone once past TRANSPOSE_HYSTERESIS of the halfway point
+  if (transpose_control.Process(cv_readings[hal::CV_7])) {
+    float semitones = transpose_control.Value() * 60.0f;
+    float distance = semitones - transpose;
+    if (distance > 0.5f + TRANSPOSE_HYSTERESIS ||
+        distance < -0.5f - TRANSPOSE_HYSTERESIS) {
+      transpose = static_cast<int>(roundf(semitones));
+      BuildStepCv();
+      UpdateRestartCv();
+    }
+  }
+
+  // Read CV input 8 for chord selection; queued steps keep the chord they
+  // were computed with
+  if (chord_control.Process(cv_readings[hal::CV_8])) {
+    ArpChord target = static_cast<ArpChord>(
+        ChangeTarget(CHANGE_CHORD, current_chord_index));
+    ArpChord new_chord = SelectChord(chord_control.Value(), target);
+    if (new_chord != target) {
+      RequestChange(CHANGE_CHORD, new_chord, current_chord_index);
+    }
+  }
+
+  // Read CV input 5 for base note (bipolar -5V to +5V)
+  base_note_cv = cv_readings[hal::CV_5];
+
+  // Average and quantize to a semitone with hysteresis, then check if the
+  // note has changed
+  if (pitch_input.Process(base_note_cv)) {
+    int new_note = pitch_input.Note();
+    if (new_note != pending_notes.root) {
+      // If we're in the middle of a pattern, queue the change; at the
+      // start of a pattern or not playing, change immediately
+      pending_notes.root = new_note;
+      QueueNoteChange();
+    }
+  }
+
+  // Collect held notes from CV_5 on gate_in_2, and from MIDI
+  if (gate_in_2_mode == GATE_IN_2_NOTES) UpdateNotePool();
+#if ARP_MIDI
+  UpdateMidiNotes();
+#endif
+
+  // Handle clock source - either internal or external gate
+  if (internal_clock_enabled) {
+    // Auto-start the arpeggio if not already triggered
+    if (!gate_triggered) {
+      restart_requests++;
+    }
+  }
+  // External gate input mode (when switch is OFF) is handled by the step
+  // scheduler from the captured gate_in_1 edges
+
+  // Recall the next preset on gate_in_2
+  if (gate_in_2_mode == GATE_IN_2_PRESET) {
+    bool preset_in = hal::ReadGate(hal::GATE_IN_2);
+    if (preset_in && !preset_in_prev) {
+      RecallPreset((preset_bank.current + 1) % PRESET_COUNT);
+    }
+    preset_in_prev = preset_in;
+  }
+  UpdatePresetRecall();
+
+  // Compute the next steps for the scheduler
+  FillStepEvents();
+
+  // Visual feedback - blink the onboard LED at tempo rate
+  // LED on for first 25% of beat (a quarter turn of the beat phase), or
+  // held on for a moment after a preset is saved
+  if (preset_flash > 0) preset_flash--;
+  hal::SetLed(preset_mode || preset_flash > 0 || beat_phase < 0x40000000u);
+
+  // Hand the settings from this pass to the scheduler
+  PublishParams();
+}
+
+// Function to copy the preset bank if a preset was saved since the last call;
+// returns false if there is nothing new to store (called from the main loop
+// with interrupts disabled)
+bool ArpTakePresetSave(PresetBank* bank) {
+  if (!preset_save_pending) return false;
+  preset_save_pending = false;
+  *bank = preset_bank;
+  return true;
+}
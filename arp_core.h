@@ -0,0 +1,180 @@
+#ifndef ARP_CORE_H_
+#define ARP_CORE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Arpeggiator engine
+// Patterns, notes, tempo tracking and the step scheduler, with no hardware
+// dependencies: inputs and outputs go through the HAL in arp_hal.h. arp.cpp
+// runs the engine on the Patch SM and sim/arp_sim.cpp on the host.
+
+// Audio configuration
+// The step scheduler runs once per audio block, so the block size sets the
+// step timing resolution (4 samples = 83us at 48kHz). A larger block cuts the
+// interrupt rate and overhead at the cost of coarser step timing.
+#ifndef ARP_AUDIO_BLOCK_SIZE
+#define ARP_AUDIO_BLOCK_SIZE 4
+#endif
+
+const size_t AUDIO_BLOCK_SIZE = ARP_AUDIO_BLOCK_SIZE;  // Samples per callback
+constexpr float SAMPLE_RATE = 48000.0f;  // Audio sample rate (Hz)
+
+// Control rate
+// Controls are read and the next steps computed by a fixed-rate control task;
+// the switch debounce and the control smoothing are tuned for this rate.
+const uint32_t CONTROL_RATE_HZ = 1000;  // Control task rate
+
+// Profiling
+// Build with ARP_PROFILE=1 to time the control task and AudioCallback with
+// the DWT cycle counter, and to measure how late steps are played against their
+// ideal sample time and how far clock intervals stray from the estimated
+// period. Each measurement keeps its min, max, mean and a histogram of
+// power-of-two buckets, and the lot is printed over the USB serial log every
+// PROFILE_REPORT_MS and then cleared, along with counts of steps that found
+// no event queued, of clock edges and MIDI notes lost to full queues and of
+// clock edges rejected by the tempo estimator.
+#ifndef ARP_PROFILE
+#define ARP_PROFILE 0
+#endif
+
+const int PROFILE_BUCKETS = 16;  // Histogram buckets per stat
+
+class TimingStat {
+ public:
+  void Init() {
+    min_ = UINT32_MAX;
+    max_ = 0;
+    sum_ = 0;
+    count_ = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) buckets_[i] = 0;
+  }
+
+  // Bucket b counts values from 2^(b-1) up to 2^b - 1 (bucket 0 is zero),
+  // the last bucket everything above
+  void Add(uint32_t value) {
+    if (value < min_) min_ = value;
+    if (value > max_) max_ = value;
+    sum_ += value;
+    count_++;
+    int bucket = value ? 32 - __builtin_clz(value) : 0;
+    if (bucket >= PROFILE_BUCKETS) bucket = PROFILE_BUCKETS - 1;
+    buckets_[bucket]++;
+  }
+
+  uint32_t Count() const { return count_; }
+  uint32_t Min() const { return count_ ? min_ : 0; }
+  uint32_t Max() const { return max_; }
+  uint32_t Mean() const {
+    return count_ ? static_cast<uint32_t>(sum_ / count_) : 0;
+  }
+  uint32_t Bucket(int bucket) const { return buckets_[bucket]; }
+
+ private:
+  uint32_t min_;
+  uint32_t max_;
+  uint64_t sum_;
+  uint32_t count_;
+  uint32_t buckets_[PROFILE_BUCKETS];
+};
+
+// All measurements, in one fixed block of RAM
+struct Profile {
+  TimingStat control;        // Control task (cycles)
+  TimingStat callback;       // AudioCallback (cycles)
+  TimingStat step_lateness;  // Step played minus its ideal time (samples)
+  TimingStat clock_jitter;   // |Clock interval - estimated period| (samples)
+  uint32_t step_underruns;       // Steps due with no event queued
+  uint32_t clock_edges_dropped;  // Clock edges lost to a full queue
+  uint32_t midi_notes_dropped;   // MIDI notes lost to a full queue
+  uint32_t clock_outliers;       // Clock edges the estimator rejected
+};
+
+extern Profile profile;  // Written by AudioCallback and the control task
+
+// MIDI input
+// Build with ARP_MIDI=0 to leave out the MIDI clock and note input. On the
+// Patch SM it takes the USB port, which a profiling build needs for its log,
+// so it is left out by default when ARP_PROFILE is set.
+#ifndef ARP_MIDI
+#define ARP_MIDI (!ARP_PROFILE)
+#endif
+
+// CV output calibration
+// Per-unit 1V/octave trim for CV_OUT_1, stored in QSPI flash. The calibrated
+// output voltage of every MIDI note is computed once at boot, so a step only
+// reads note_cv_table.
+const uint32_t CV_CALIBRATION_VERSION = 1;
+const float CAL_OFFSET_RANGE = 0.05f;  // Offset trim range (+/- volts)
+const float CAL_SCALE_RANGE = 0.02f;   // Scale trim range (+/- 2%, ~24 cents)
+const int CAL_LOW_NOTE = 23;           // Reference note at 1V (toggle off)
+const int CAL_HIGH_NOTE = 59;          // Reference note at 4V (toggle on)
+const int NOTE_COUNT = 128;            // MIDI notes in note_cv_table
+
+struct CvCalibration {
+  uint32_t version;
+  float scale;   // Output volts per nominal volt
+  float offset;  // Volts added after scaling
+
+  bool operator==(const CvCalibration& other) const {
+    return version == other.version && scale == other.scale &&
+           offset == other.offset;
+  }
+  bool operator!=(const CvCalibration& other) const {
+    return !(*this == other);
+  }
+};
+
+const CvCalibration default_calibration = {CV_CALIBRATION_VERSION, 1.0f,
+                                           0.0f};
+
+// Presets
+// PRESET_COUNT sets of panel settings, kept by the platform in flash. The
+// layout is packed and versioned: bump PRESET_VERSION whenever Preset or
+// PresetBank changes, and a stored bank of another version is ignored.
+const int PRESET_COUNT = 8;        // Preset slots
+const uint8_t PRESET_VERSION = 1;  // PresetBank layout
+
+struct __attribute__((packed)) Preset {
+  uint8_t pattern;       // ArpPattern (K1)
+  uint8_t octave_range;  // Octave range index (K1 shifted)
+  uint16_t bpm_x10;      // Tempo in 0.1 BPM (K2, internal clock)
+  uint8_t groove;        // Groove index (K2 shifted)
+  uint8_t clock_ratio;   // Clock ratio index (K3)
+  uint8_t rhythm;        // Rhythm index (K3 shifted)
+  uint8_t rotation;      // Rhythm rotation (K4 shifted)
+  uint8_t gate_length;   // Gate knob position x 255 (K4)
+};
+
+struct __attribute__((packed)) PresetBank {
+  uint8_t version;  // PRESET_VERSION
+  uint8_t current;  // Slot last saved or recalled
+  Preset presets[PRESET_COUNT];
+};
+
+// Function to convert MIDI note to calibrated, clamped CV_OUT_1 voltage
+float CalibratedNoteToCv(int midi_note, const CvCalibration& cal);
+
+// Function to clear the measurements
+void ResetProfile();
+
+// Function to set up the engine with the CV output calibration and the
+// stored presets, or nullptr for none (called once at boot, before audio
+// starts)
+void ArpInit(const CvCalibration& calibration, const PresetBank* presets);
+
+// Function to capture the clock and advance the step scheduler by one audio
+// block (called from the audio callback, before any audio is processed, so
+// outputs change at the start of the block)
+void ArpProcessBlock(const float* audio_in, size_t size);
+
+// Function to read the controls and compute the next steps (called from the
+// control task, CONTROL_RATE_HZ)
+void ArpProcessControls();
+
+// Function to copy the preset bank if a preset was saved since the last call;
+// returns false if there is nothing new to store (called from the main loop
+// with interrupts disabled)
+bool ArpTakePresetSave(PresetBank* bank);
+
+#endif  // ARP_CORE_H_
@@ -0,0 +1,99 @@
+#ifndef ARP_HAL_H_
+#define ARP_HAL_H_
+
+#include <cstdint>
+
+// Hardware abstraction layer
+// Everything the engine in arp_core.cpp reads from or writes to the panel.
+// arp.cpp implements it on the Patch SM and sim/arp_sim.cpp on the host, so
+// the engine runs unchanged off-target. Inputs return the state last
+// processed by the platform (ProcessAllControls and Debounce on hardware).
+// The gate and CV output functions are called from the audio callback.
+namespace hal {
+
+enum CvInput {
+  CV_1 = 0,  // K1 (pattern, octave range while shifted)
+  CV_2,      // K2 (tempo, groove while shifted)
+  CV_3,      // K3 (clock rate, rhythm while shifted)
+  CV_4,      // K4 (gate length, rhythm rotation while shifted)
+  CV_5,      // Pitch (1V/octave, bipolar)
+  CV_6,      // Step probability
+  CV_7,      // Transpose (1V/octave, bipolar)
+  CV_8,      // Chord
+};
+
+enum GateInput {
+  GATE_IN_1 = 0,  // External clock
+  GATE_IN_2,      // Note pool gate or reset / run
+};
+
+enum GateOutput {
+  GATE_OUT_1 = 0,  // Main track
+  GATE_OUT_2,      // Second track
+};
+
+enum CvOutput {
+  CV_OUT_1 = 0,  // Main track pitch (calibrated 1V/octave)
+  CV_OUT_2,      // Second track pitch
+};
+
+// Push button state, debounced
+struct ButtonState {
+  bool pressed;       // Held down
+  bool rising_edge;   // Pressed since the last read
+  bool falling_edge;  // Released since the last read
+  float held_ms;      // Time held so far (ms)
+};
+
+// MIDI message types, by status byte (channel messages on any channel)
+enum MidiStatus {
+  MIDI_NOTE_OFF = 0x80,
+  MIDI_NOTE_ON = 0x90,
+  MIDI_CLOCK = 0xf8,
+  MIDI_START = 0xfa,
+  MIDI_CONTINUE = 0xfb,
+  MIDI_STOP = 0xfc,
+};
+
+// MIDI input message, already parsed
+struct MidiMessage {
+  uint8_t status;  // MidiStatus
+  uint8_t note;    // Note number (note on / off)
+  uint8_t velocity;
+};
+
+// Knob or CV reading: 0 to 1 for pots, -1 to 1 (-5V to 5V) for CV jacks
+float ReadCv(CvInput input);
+
+// Unfiltered knob or CV reading straight from the ADC, same range as ReadCv
+// (called from the audio callback)
+float SampleCv(CvInput input);
+
+// Gate input state
+bool ReadGate(GateInput input);
+
+// Set a gate output
+void WriteGate(GateOutput output, bool state);
+
+// Write a CV output (0 to 5V)
+void WriteCv(CvOutput output, float volts);
+
+// Push button state
+ButtonState ReadButton();
+
+// Next MIDI message received, in order; returns false when there are none
+// left (called from the audio callback)
+bool ReadMidi(MidiMessage* message);
+
+// Toggle switch state (on = internal clock)
+bool ReadToggle();
+
+// Onboard LED
+void SetLed(bool on);
+
+// Random seed
+uint32_t RandomValue();
+
+}  // namespace hal
+
+#endif  // ARP_HAL_H_
@@ -0,0 +1,421 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "arp_core.h"
+#include "arp_hal.h"
+
+// Host simulation of the arpeggiator engine
+// Replays a recorded CV / gate trace through arp_core.cpp faster than real
+// time, at the same rates as the Patch SM: ArpProcessBlock every
+// AUDIO_BLOCK_SIZE samples and ArpProcessControls once per ms. Every gate and
+// CV output change is logged with its sample time, so the log of one build
+// can be diffed against another with -r, and the engine's step timing
+// measurements and the throughput are reported on stderr. A CV written on
+// consecutive blocks is a glide ramp, and only its first and last values
+// are logged.
+//
+// Usage: arp_sim [-l loops] [-o log] [-r reference_log] trace
+//
+// Trace lines are "<sample> <input> <value>" in time order, where the input
+// is cv1 to cv8 (0 to 1 for pots, -1 to 1 for CV jacks), gate1, gate2,
+// button or toggle (0 or 1), or note_on / note_off (MIDI note number).
+// midi_clock, midi_start, midi_continue and midi_stop take no value, and
+// "<sample> end" sets the trace length.
+// Anything after # is a comment. The audio input is silent, so the audio
+// clock source is not simulated.
+#if !ARP_PROFILE
+#error "arp_sim needs the engine measurements, build with ARP_PROFILE=1"
+#endif
+
+// Samples between control task runs, as on the hardware timer
+const uint32_t CONTROL_PERIOD_SAMPLES =
+    static_cast<uint32_t>(SAMPLE_RATE) / CONTROL_RATE_HZ;
+const uint32_t TRACE_TAIL_SAMPLES = 48000;  // Run on after the last event
+
+enum TraceInput {
+  INPUT_CV_1 = 0,  // cv1 to cv8 are INPUT_CV_1 + n - 1
+  INPUT_GATE_1 = 8,
+  INPUT_GATE_2,
+  INPUT_BUTTON,
+  INPUT_TOGGLE,
+  INPUT_NOTE_ON,
+  INPUT_NOTE_OFF,
+  INPUT_MIDI_CLOCK,  // MIDI real-time messages, no value
+  INPUT_MIDI_START,
+  INPUT_MIDI_CONTINUE,
+  INPUT_MIDI_STOP,
+  INPUT_END,
+};
+
+struct TraceEvent {
+  uint32_t sample;  // Sample time within the trace
+  int input;        // TraceInput
+  float value;      // New input value
+};
+
+// Simulated panel
+float cv_in[8];                       // CV_1 to CV_8
+bool gate_in[2];                      // gate_in_1, gate_in_2
+bool toggle_on = false;               // Toggle switch
+bool button_down = false;             // Push button
+bool button_read = false;             // Button state at the last ReadButton
+uint32_t button_press_sample = 0;     // Sample time of the last press
+std::deque<hal::MidiMessage> midi_in;  // MIDI received, not yet read
+bool gate_out[2];                     // gate_out_1, gate_out_2
+float cv_out[2] = {-1.0f, -1.0f};     // CV_OUT_1, CV_OUT_2 (-1 = unwritten)
+uint32_t cv_write_sample[2];          // Block of the last write of each CV
+bool cv_ramp_pending[2];              // Last value of a ramp not logged yet
+uint32_t random_state = 0x2545f491u;  // Fixed seed, so runs repeat
+uint32_t now = 0;                     // Sample time of the current block
+std::vector<std::string> output_log;  // Output changes, in time order
+size_t block_log_start = 0;           // First output_log line of this block
+
+const char* const cv_output_names[2] = {"cv_out_1", "cv_out_2"};
+
+// Function to format an output change at a sample time
+std::string LogLine(uint32_t sample, const char* output, float value) {
+  char line[64];
+  snprintf(line, sizeof(line), "%u %s %.4f", sample, output, value);
+  return line;
+}
+
+// Function to log an output change at the current block
+void LogOutput(const char* output, float value) {
+  output_log.push_back(LogLine(now, output, value));
+}
+
+// Function to log the last value of any CV ramp that was not written on the
+// current block, ahead of this block's changes; all of them at the end
+void EndCvRamps(bool end_of_trace) {
+  for (int output = 0; output < 2; output++) {
+    if (!cv_ramp_pending[output]) continue;
+    if (!end_of_trace && cv_write_sample[output] == now) continue;
+    cv_ramp_pending[output] = false;
+    std::string line = LogLine(cv_write_sample[output],
+                               cv_output_names[output], cv_out[output]);
+    size_t position = end_of_trace ? output_log.size() : block_log_start;
+    output_log.insert(output_log.begin() + position, line);
+  }
+}
+
+namespace hal {
+
+float ReadCv(CvInput input) { return cv_in[input]; }
+
+float SampleCv(CvInput input) { return cv_in[input]; }
+
+bool ReadGate(GateInput input) { return gate_in[input]; }
+
+void WriteGate(GateOutput output, bool state) {
+  if (gate_out[output] == state) return;
+  gate_out[output] = state;
+  LogOutput(output == GATE_OUT_1 ? "gate_out_1" : "gate_out_2",
+            state ? 1.0f : 0.0f);
+}
+
+void WriteCv(CvOutput output, float volts) {
+  if (cv_out[output] == volts) return;
+  bool ramp = cv_out[output] >= 0.0f &&
+              now - cv_write_sample[output] == AUDIO_BLOCK_SIZE;
+  cv_out[output] = volts;
+  cv_write_sample[output] = now;
+  cv_ramp_pending[output] = ramp;
+  if (!ramp) LogOutput(cv_output_names[output], volts);
+}
+
+// Edges are since the last read, like Switch::Debounce once per loop
+ButtonState ReadButton() {
+  ButtonState state;
+  state.pressed = button_down;
+  state.rising_edge = button_down && !button_read;
+  state.falling_edge = !button_down && button_read;
+  state.held_ms =
+      button_down ? (now - button_press_sample) * 1000.0f / SAMPLE_RATE : 0.0f;
+  button_read = button_down;
+  return state;
+}
+
+bool ReadMidi(MidiMessage* message) {
+  if (midi_in.empty()) return false;
+  *message = midi_in.front();
+  midi_in.pop_front();
+  return true;
+}
+
+bool ReadToggle() { return toggle_on; }
+
+void SetLed(bool) {}
+
+uint32_t RandomValue() {
+  random_state = random_state * 1664525u + 1013904223u;
+  return random_state;
+}
+
+}  // namespace hal
+
+// Function to parse a trace input name, -1 if unknown
+int ParseInput(const char* name) {
+  if (strncmp(name, "cv", 2) == 0 && name[2] >= '1' && name[2] <= '8' &&
+      name[3] == '\0') {
+    return INPUT_CV_1 + name[2] - '1';
+  }
+  if (strcmp(name, "gate1") == 0) return INPUT_GATE_1;
+  if (strcmp(name, "gate2") == 0) return INPUT_GATE_2;
+  if (strcmp(name, "button") == 0) return INPUT_BUTTON;
+  if (strcmp(name, "toggle") == 0) return INPUT_TOGGLE;
+  if (strcmp(name, "note_on") == 0) return INPUT_NOTE_ON;
+  if (strcmp(name, "note_off") == 0) return INPUT_NOTE_OFF;
+  if (strcmp(name, "midi_clock") == 0) return INPUT_MIDI_CLOCK;
+  if (strcmp(name, "midi_start") == 0) return INPUT_MIDI_START;
+  if (strcmp(name, "midi_continue") == 0) return INPUT_MIDI_CONTINUE;
+  if (strcmp(name, "midi_stop") == 0) return INPUT_MIDI_STOP;
+  if (strcmp(name, "end") == 0) return INPUT_END;
+  return -1;
+}
+
+// Function to load a trace; returns false on a read or parse error
+bool LoadTrace(const char* path, std::vector<TraceEvent>* events,
+               uint32_t* length) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "arp_sim: can't open %s\n", path);
+    return false;
+  }
+  char line[256];
+  int line_number = 0;
+  uint32_t last_sample = 0;
+  bool has_end = false;
+  while (fgets(line, sizeof(line), file)) {
+    line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    unsigned sample;
+    char name[16];
+    float value = 0.0f;
+    int fields = sscanf(line, "%u %15s %f", &sample, name, &value);
+    if (fields <= 0) continue;
+    TraceEvent event;
+    event.sample = sample;
+    event.input = fields >= 2 ? ParseInput(name) : -1;
+    event.value = value;
+    bool needs_value =
+        event.input < INPUT_MIDI_CLOCK || event.input > INPUT_MIDI_STOP;
+    if (event.input < 0 ||
+        (fields < 3 && needs_value && event.input != INPUT_END) ||
+        sample < last_sample) {
+      fprintf(stderr, "arp_sim: %s:%d: bad event\n", path, line_number);
+      fclose(file);
+      return false;
+    }
+    last_sample = sample;
+    if (event.input == INPUT_END) {
+      *length = sample;
+      has_end = true;
+    } else {
+      events->push_back(event);
+    }
+  }
+  fclose(file);
+  if (!has_end) *length = last_sample + TRACE_TAIL_SAMPLES;
+  return true;
+}
+
+// Function to queue a MIDI message from a trace event
+void QueueMidi(uint8_t status, float note) {
+  hal::MidiMessage message;
+  message.status = status;
+  message.note = static_cast<uint8_t>(note);
+  message.velocity = status == hal::MIDI_NOTE_ON ? 100 : 0;
+  midi_in.push_back(message);
+}
+
+// Function to apply a trace event to the simulated panel
+void ApplyEvent(const TraceEvent& event) {
+  bool state = event.value >= 0.5f;
+  switch (event.input) {
+    case INPUT_NOTE_ON:
+      QueueMidi(hal::MIDI_NOTE_ON, event.value);
+      break;
+    case INPUT_NOTE_OFF:
+      QueueMidi(hal::MIDI_NOTE_OFF, event.value);
+      break;
+    case INPUT_MIDI_CLOCK:
+      QueueMidi(hal::MIDI_CLOCK, 0.0f);
+      break;
+    case INPUT_MIDI_START:
+      QueueMidi(hal::MIDI_START, 0.0f);
+      break;
+    case INPUT_MIDI_CONTINUE:
+      QueueMidi(hal::MIDI_CONTINUE, 0.0f);
+      break;
+    case INPUT_MIDI_STOP:
+      QueueMidi(hal::MIDI_STOP, 0.0f);
+      break;
+    case INPUT_GATE_1:
+    case INPUT_GATE_2:
+      gate_in[event.input - INPUT_GATE_1] = state;
+      break;
+    case INPUT_BUTTON:
+      if (state && !button_down) button_press_sample = now;
+      button_down = state;
+      break;
+    case INPUT_TOGGLE:
+      toggle_on = state;
+      break;
+    default:
+      cv_in[event.input - INPUT_CV_1] = event.value;
+      break;
+  }
+}
+
+// Function to compare the output log with a reference log; returns the
+// number of lines that differ
+int DiffReference(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "arp_sim: can't open %s\n", path);
+    return -1;
+  }
+  int differences = 0;
+  size_t line_index = 0;
+  char line[128];
+  while (fgets(line, sizeof(line), file)) {
+    line[strcspn(line, "\n")] = '\0';
+    bool same =
+        line_index < output_log.size() && output_log[line_index] == line;
+    if (!same) {
+      if (differences == 0) {
+        fprintf(stderr, "first difference at line %zu: expected \"%s\", ",
+                line_index + 1, line);
+        fprintf(stderr, "got \"%s\"\n", line_index < output_log.size()
+                                            ? output_log[line_index].c_str()
+                                            : "end of log");
+      }
+      differences++;
+    }
+    line_index++;
+  }
+  fclose(file);
+  if (line_index < output_log.size()) {
+    if (differences == 0) {
+      fprintf(stderr, "first difference at line %zu: log is longer\n",
+              line_index + 1);
+    }
+    differences += output_log.size() - line_index;
+  }
+  return differences;
+}
+
+// Function to print one measurement
+void PrintTimingStat(const char* name, const TimingStat& stat) {
+  fprintf(stderr, "%s: n=%u min=%u mean=%u max=%u samples (max %.1f us)\n",
+          name, stat.Count(), stat.Min(), stat.Mean(), stat.Max(),
+          stat.Max() * 1e6f / SAMPLE_RATE);
+  fprintf(stderr, " ");
+  for (int i = 0; i < PROFILE_BUCKETS; i++) {
+    fprintf(stderr, " %u", stat.Bucket(i));
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv) {
+  int loops = 1;
+  const char* log_path = nullptr;
+  const char* reference_path = nullptr;
+  const char* trace_path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      loops = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      log_path = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      reference_path = argv[++i];
+    } else {
+      trace_path = argv[i];
+    }
+  }
+  if (!trace_path || loops < 1) {
+    fprintf(stderr,
+            "usage: arp_sim [-l loops] [-o log] [-r reference_log] trace\n");
+    return 2;
+  }
+
+  std::vector<TraceEvent> events;
+  uint32_t length = 0;
+  if (!LoadTrace(trace_path, &events, &length)) return 2;
+
+  // Inputs at sample 0 are in place before the engine starts, as if they
+  // were set at power-up
+  size_t next_event = 0;
+  while (next_event < events.size() && events[next_event].sample == 0) {
+    ApplyEvent(events[next_event++]);
+  }
+  ArpInit(default_calibration, nullptr);
+
+  // Replay; each loop of the trace carries on from where the last one left
+  // the engine
+  const float silence[AUDIO_BLOCK_SIZE] = {};
+  auto start = std::chrono::steady_clock::now();
+  for (int loop = 0; loop < loops; loop++) {
+    uint32_t loop_start = loop * length;
+    if (loop > 0) next_event = 0;
+    for (uint32_t t = 0; t < length; t += AUDIO_BLOCK_SIZE) {
+      now = loop_start + t;
+      block_log_start = output_log.size();
+      while (next_event < events.size() &&
+             events[next_event].sample < t + AUDIO_BLOCK_SIZE) {
+        ApplyEvent(events[next_event++]);
+      }
+      ArpProcessBlock(silence, AUDIO_BLOCK_SIZE);
+      if (t % CONTROL_PERIOD_SAMPLES == 0) ArpProcessControls();
+      EndCvRamps(false);
+    }
+  }
+  EndCvRamps(true);
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  if (log_path) {
+    FILE* file = strcmp(log_path, "-") == 0 ? stdout : fopen(log_path, "w");
+    if (!file) {
+      fprintf(stderr, "arp_sim: can't write %s\n", log_path);
+      return 2;
+    }
+    for (const std::string& line : output_log) {
+      fprintf(file, "%s\n", line.c_str());
+    }
+    if (file != stdout) fclose(file);
+  }
+
+  double simulated = static_cast<double>(length) * loops / SAMPLE_RATE;
+  uint32_t steps = profile.step_lateness.Count();
+  fprintf(stderr, "trace: %zu events, %.1f s x %d\n", events.size(),
+          length / SAMPLE_RATE, loops);
+  PrintTimingStat("step lateness", profile.step_lateness);
+  PrintTimingStat("clock jitter", profile.clock_jitter);
+  fprintf(stderr, "clock outliers: %u\n", profile.clock_outliers);
+  fprintf(stderr, "dropped: %u steps, %u clock edges, %u midi notes\n",
+          profile.step_underruns, profile.clock_edges_dropped,
+          profile.midi_notes_dropped);
+  fprintf(stderr,
+          "throughput: %u steps in %.3f s, %.0f steps/s, %.0fx real time\n",
+          steps, seconds, steps / seconds, simulated / seconds);
+
+  if (reference_path) {
+    int differences = DiffReference(reference_path);
+    if (differences < 0) return 2;
+    if (differences > 0) {
+      fprintf(stderr, "regression: %d of %zu lines differ from %s\n",
+              differences, output_log.size(), reference_path);
+      return 1;
+    }
+    fprintf(stderr, "regression: %zu lines match %s\n", output_log.size(),
+            reference_path);
+  }
+  return 0;
+}